@@ -1,4 +1,5 @@
 #include "Commands.h"
+#include "signals.h"
 #include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -11,13 +12,25 @@
 #include <sstream>
 #include <vector>
 #include <map> // made changes here
-#include <regex>
+#include <new>
 #include <dirent.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
 #include <chrono>
 #include <thread>
+#include <spawn.h>
+#include <glob.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 // newest
 using namespace std;
 
@@ -37,7 +50,7 @@ const std::string WHITESPACE = " \n\r\t\f\v";
     {                                                   \
         if ((syscall) == -1)                            \
         {                                               \
-            perror("smash error: " #syscall " failed"); \
+            _perror("smash error: " #syscall " failed"); \
         }                                               \
     } while (0)
 
@@ -55,36 +68,245 @@ string _rtrim(const std::string &s)
 
 string _trim(const std::string &s) { return _rtrim(_ltrim(s)); }
 
-int _parseCommandLine(const char *cmd_line, char **args)
+void *CommandArena::allocate(size_t size)
 {
-    FUNC_ENTRY()
+    // keep every block pointer-aligned, argv lives here too
+    const size_t align = alignof(char *);
+    size = (size + align - 1) & ~(align - 1);
+    if (size > remaining)
+    {
+        size_t chunk_size = size + sizeof(char *) > CHUNK_SIZE ? size + sizeof(char *) : CHUNK_SIZE;
+        char *chunk = static_cast<char *>(::operator new(chunk_size));
+        *reinterpret_cast<char **>(chunk) = chunks;
+        chunks = chunk;
+        cursor = chunk + sizeof(char *);
+        remaining = chunk_size - sizeof(char *);
+    }
+    void *block = cursor;
+    cursor += size;
+    remaining -= size;
+    return block;
+}
+
+char *CommandArena::copyString(const char *str, size_t length)
+{
+    char *copy = static_cast<char *>(allocate(length + 1));
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+void CommandArena::reset()
+{
+    while (chunks != nullptr)
+    {
+        char *previous = *reinterpret_cast<char **>(chunks);
+        ::operator delete(chunks);
+        chunks = previous;
+    }
+    cursor = inlineBuf;
+    remaining = INLINE_SIZE;
+}
+
+static inline bool _isWhitespace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\v';
+}
+
+static inline bool _isOperator(char c)
+{
+    return c == '>' || c == '|' || c == '&';
+}
+
+// The lexer proper. One pass over the line; with out == nullptr it only
+// counts the tokens, otherwise it fills out[] and writes the unquoted words
+// back to back into text.
+static int _lexScan(const char *line, Token *out, char *text)
+{
+    int count = 0;
+    const char *p = line;
+    while (true)
+    {
+        while (_isWhitespace(*p))
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            break;
+        }
+
+        Token token;
+        token.start = p - line;
+        token.quoted = false;
+        if (_isOperator(*p))
+        {
+            if (p[0] == '>' && p[1] == '>')
+            {
+                token.type = TokenAppend;
+                token.text = ">>";
+            }
+            else if (p[0] == '>')
+            {
+                token.type = TokenRedirect;
+                token.text = ">";
+            }
+            else if (p[0] == '|' && p[1] == '&')
+            {
+                token.type = TokenPipeErr;
+                token.text = "|&";
+            }
+            else if (p[0] == '|')
+            {
+                token.type = TokenPipe;
+                token.text = "|";
+            }
+            else
+            {
+                token.type = TokenBackground;
+                token.text = "&";
+            }
+            p += strlen(token.text);
+            token.end = p - line;
+            if (out)
+            {
+                out[count] = token;
+            }
+            count++;
+            continue;
+        }
+
+        token.type = TokenWord;
+        token.text = text;
+        while (*p != '\0' && !_isWhitespace(*p) && !_isOperator(*p))
+        {
+            if (*p == '\'')
+            {
+                // everything up to the closing quote is literal
+                token.quoted = true;
+                for (p++; *p != '\0' && *p != '\''; p++)
+                {
+                    if (text)
+                        *text++ = *p;
+                }
+                if (*p != '\0')
+                    p++;
+            }
+            else if (*p == '"')
+            {
+                // only \" \\ \$ and \` are escapes inside double quotes
+                token.quoted = true;
+                for (p++; *p != '\0' && *p != '"'; p++)
+                {
+                    if (p[0] == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$' || p[1] == '`'))
+                        p++;
+                    if (text)
+                        *text++ = *p;
+                }
+                if (*p != '\0')
+                    p++;
+            }
+            else if (p[0] == '\\' && p[1] != '\0')
+            {
+                token.quoted = true;
+                if (text)
+                    *text++ = p[1];
+                p += 2;
+            }
+            else
+            {
+                if (text)
+                    *text++ = *p;
+                p++;
+            }
+        }
+        token.end = p - line;
+        if (out)
+        {
+            *text++ = '\0';
+            out[count] = token;
+        }
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Lexes cmd_line into a token stream allocated from arena: words (quotes
+ * and escapes resolved) and the operators >, >>, |, |& and &. Returns the
+ * number of tokens.
+ * #_lexCommandLine
+ */
+int _lexCommandLine(const char *cmd_line, Token **tokens, CommandArena *arena)
+{
+    SMASH_PROBE(StatParse);
+    int count = _lexScan(cmd_line, nullptr, nullptr);
+    *tokens = static_cast<Token *>(arena->allocate((count > 0 ? count : 1) * sizeof(Token)));
+    // unquoting never makes a word longer, one NUL per token on top
+    char *text = static_cast<char *>(arena->allocate(strlen(cmd_line) + count + 1));
+    _lexScan(cmd_line, *tokens, text);
+    return count;
+}
+
+// argv made of the word tokens. The vector is NULL terminated and never
+// shorter than COMMAND_MAX_ARGS + 1 entries, so looking at args[i] past the
+// last argument reads NULL.
+static int _tokensToArgv(const Token *tokens, int num_tokens, char ***args, CommandArena *arena)
+{
+    int slots = std::max(num_tokens + 1, COMMAND_MAX_ARGS + 1);
+    char **argv = static_cast<char **>(arena->allocate(slots * sizeof(char *)));
+    memset(argv, 0, slots * sizeof(char *));
+
     int i = 0;
-    std::istringstream iss(_trim(string(cmd_line)).c_str());
-    for (std::string s; iss >> s;)
+    for (int t = 0; t < num_tokens; t++)
     {
-        args[i] = (char *)malloc(s.length() + 1);
-        memset(args[i], 0, s.length() + 1);
-        strcpy(args[i], s.c_str());
-        args[++i] = NULL;
+        if (tokens[t].type == TokenWord)
+        {
+            argv[i++] = (char *)tokens[t].text;
+        }
     }
+    *args = argv;
     return i;
+}
+
+/**
+ * Lexes cmd_line and returns its words as an argv vector allocated from
+ * arena; operators are dropped.
+ * #_parseCommandLine
+ */
+int _parseCommandLine(const char *cmd_line, char ***args, CommandArena *arena)
+{
+    FUNC_ENTRY()
+    Token *tokens;
+    int num_tokens = _lexCommandLine(cmd_line, &tokens, arena);
+    return _tokensToArgv(tokens, num_tokens, args, arena);
 
     FUNC_EXIT()
 }
 
+// Index of the last non whitespace character, or -1
+static int _lastNonWhitespace(const char *cmd_line, int from)
+{
+    int idx = from;
+    while (idx >= 0 && _isWhitespace(cmd_line[idx]))
+    {
+        idx--;
+    }
+    return idx;
+}
+
 bool _isBackgroundComamnd(const char *cmd_line)
 {
-    const string str(cmd_line);
-    return str[str.find_last_not_of(WHITESPACE)] == '&';
+    int idx = _lastNonWhitespace(cmd_line, (int)strlen(cmd_line) - 1);
+    return idx >= 0 && cmd_line[idx] == '&';
 }
 
 void _removeBackgroundSign(char *cmd_line)
 {
-    const string str(cmd_line);
     // find last character other than spaces
-    unsigned int idx = str.find_last_not_of(WHITESPACE);
+    int idx = _lastNonWhitespace(cmd_line, (int)strlen(cmd_line) - 1);
     // if all characters are spaces then return
-    if (idx == string::npos)
+    if (idx < 0)
     {
         return;
     }
@@ -97,12 +319,12 @@ void _removeBackgroundSign(char *cmd_line)
     // spaces.
     cmd_line[idx] = ' ';
     // truncate the command line string up to the last non-space character
-    cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
+    cmd_line[_lastNonWhitespace(cmd_line, idx) + 1] = 0;
 }
 
-// Alias data structure
-map<string, string> aliases; // made changes here
-list<string> aliasOrder;
+////////////////////////////////////////////////////////////////////////
+///                              #Aliases                            ///
+////////////////////////////////////////////////////////////////////////
 
 // Helper function to check if a string is a reserved keyword
 bool isReservedKeyword(const string &name)
@@ -111,1627 +333,4966 @@ bool isReservedKeyword(const string &name)
     return find(reservedKeywords.begin(), reservedKeywords.end(), name) != reservedKeywords.end();
 }
 
-// Function to add an alias
-void addAlias(const string &name, const string &command)
+static bool _isAliasNameChar(char c)
 {
-    if (isReservedKeyword(name))
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Splits name='command'. name is one or more of [A-Za-z0-9_], the command
+// is everything between the first and the last quote.
+bool AliasTable::parseDefinition(const std::string &definition, std::string *name, std::string *command)
+{
+    size_t i = 0;
+    while (i < definition.size() && _isAliasNameChar(definition[i]))
     {
-        cerr << "smash error: alias: " << name << " already exists or is a reserved command " << endl;
-        return;
+        i++;
     }
-    // Check if alias already exists
-    if (aliases.find(name) == aliases.end())
+    if (i == 0 || definition.size() < i + 3 || definition[i] != '=' || definition[i + 1] != '\'' ||
+        definition[definition.size() - 1] != '\'')
     {
-        // New alias, add to map and order list
-        aliases[name] = command;
-        aliasOrder.push_back(name);
+        return false;
     }
-    else
+    *name = definition.substr(0, i);
+    *command = definition.substr(i + 2, definition.size() - i - 3);
+    return true;
+}
+
+// false when name is taken already
+bool AliasTable::add(const std::string &name, const std::string &command)
+{
+    if (table.find(name) != table.end())
     {
-        // Existing alias, update command
-        // aliases[name] = command;
-        cerr << "smash error: alias: " << name << " already exists or is a reserved command " << endl;
-        return;
+        return false;
+    }
+    Alias &alias = table[name];
+    alias.command = command;
+    alias.position = order.insert(order.end(), name);
+    alias.generation = 0;
+    // the expansion of any other alias may go through this one now
+    generation++;
+    return true;
+}
+
+bool AliasTable::remove(const std::string &name)
+{
+    std::unordered_map<std::string, Alias>::iterator it = table.find(name);
+    if (it == table.end())
+    {
+        return false;
+    }
+    order.erase(it->second.position);
+    table.erase(it);
+    generation++;
+    return true;
+}
+
+// Substitutes aliases in the first word of name's command for as long as
+// there is one. An alias met a second time ends it, e.g. alias ls='ls -l'
+// runs the ls program, like in bash.
+void AliasTable::memoize(const std::string &name, Alias *alias)
+{
+    std::string text = alias->command;
+    std::vector<std::string> seen(1, name);
+    while (true)
+    {
+        CommandArena arena;
+        Token *tokens;
+        int num_tokens = _lexCommandLine(text.c_str(), &tokens, &arena);
+        if (num_tokens == 0 || tokens[0].type != TokenWord || tokens[0].quoted ||
+            std::find(seen.begin(), seen.end(), tokens[0].text) != seen.end())
+        {
+            break;
+        }
+        std::unordered_map<std::string, Alias>::const_iterator inner = table.find(tokens[0].text);
+        if (inner == table.end())
+        {
+            break;
+        }
+        seen.push_back(tokens[0].text);
+        text = inner->second.command + text.substr(tokens[0].end);
+    }
+
+    AliasExpansion &expansion = alias->expansion;
+    expansion.text = text;
+    CommandArena arena;
+    Token *tokens;
+    int num_tokens = _lexCommandLine(text.c_str(), &tokens, &arena);
+    expansion.tokens.assign(tokens, tokens + num_tokens);
+    expansion.words.clear();
+    std::vector<size_t> offsets;
+    for (int i = 0; i < num_tokens; i++)
+    {
+        offsets.push_back(expansion.words.size());
+        expansion.words.append(tokens[i].text);
+        expansion.words.push_back('\0');
+    }
+    for (int i = 0; i < num_tokens; i++)
+    {
+        expansion.tokens[i].text = expansion.words.data() + offsets[i];
     }
+
+    // An open quote or a trailing backslash would swallow whatever follows
+    // on the line, such an alias is lexed together with the line instead.
+    std::string probe = text + " x";
+    arena.reset();
+    int probe_tokens = _lexCommandLine(probe.c_str(), &tokens, &arena);
+    expansion.splices = probe_tokens == num_tokens + 1 && strcmp(tokens[num_tokens].text, "x") == 0;
+
+    alias->generation = generation;
 }
 
-// Function to print all aliases in insertion order
-void printAliases()
+const AliasExpansion *AliasTable::expand(const std::string &name)
 {
-    for (const string &name : aliasOrder)
+    std::unordered_map<std::string, Alias>::iterator it = table.find(name);
+    if (it == table.end())
+    {
+        return nullptr;
+    }
+    if (it->second.generation != generation)
     {
-        cout << name << "='" << aliases[name] << "'" << endl;
+        memoize(name, &it->second);
     }
+    return &it->second.expansion;
 }
 
-// Alias command implementation
-void handleAliasCommand(const vector<string> &args, const string &original_cmd_line)
+// All aliases in insertion order
+void AliasTable::print() const
 {
-    if (args.size() == 1)
+    for (std::list<std::string>::const_iterator it = order.begin(); it != order.end(); it++)
     {
-        // List all aliases
-        printAliases();
-        return;
+        cout << *it << "='" << table.find(*it)->second.command << "'" << endl;
     }
+}
 
-    // Combine all args into a single string (in case there are spaces in the command part)
-    string aliasDefinition;
-    for (size_t i = 1; i < args.size(); ++i)
+// the definition is taken raw, its quotes are part of the syntax
+void AliasCommand::execute()
+{
+    SmallShell &smash = SmallShell::getInstance();
+    if (num_tokens <= 1)
     {
-        if (i > 1)
-            aliasDefinition += " ";
-        aliasDefinition += args[i];
+        // List all aliases
+        smash.aliases.print();
+        return;
     }
 
-    std::regex aliasRegex(R"((\w+)='(.*)')");
-    std::smatch match;
-    if (!std::regex_match(aliasDefinition, match, aliasRegex) || match.size() != 3)
+    string name;
+    string command;
+    if (!AliasTable::parseDefinition(_trim(string(cmd_line + tokens[0].end)), &name, &command))
     {
         cout << "smash error: alias: invalid alias format" << endl;
         return;
     }
-
-    string name = match[1].str();
-    string command = match[2].str();
-
-    addAlias(name, command);
+    if (isReservedKeyword(name) || !smash.aliases.add(name, command))
+    {
+        cerr << "smash error: alias: " << name << " already exists or is a reserved command " << endl;
+    }
 }
+REGISTER_BUILTIN("alias", AliasCommand);
 
-// Unalias command implementation
-void handleUnaliasCommand(const vector<string> &args)
+void UnaliasCommand::execute()
 {
-    if (args.size() < 2)
+    SmallShell &smash = SmallShell::getInstance();
+    if (num_args < 2)
     {
         cerr << "smash error: unalias: not enough arguments" << endl;
         return;
     }
 
-    for (size_t i = 1; i < args.size(); ++i)
+    for (int i = 1; i < num_args; ++i)
     {
-        const string &name = args[i];
-        auto it = aliases.find(name);
-        if (it != aliases.end())
-        {
-            aliases.erase(it);
-            aliasOrder.remove(name);
-        }
-        else
+        if (!smash.aliases.remove(args[i]))
         {
-            cerr << "smash error: unalias: " << name << " alias does not exist" << endl;
+            cerr << "smash error: unalias: " << args[i] << " alias does not exist" << endl;
             return;
         }
     }
 }
+REGISTER_BUILTIN("unalias", UnaliasCommand);
 
-class ListDirCommand : public Command
+std::vector<std::string> BuiltinRegistry::names() const
 {
-public:
-    ListDirCommand(const char *cmd_line) : Command(cmd_line) {}
-    void execute() override
+    std::vector<std::string> result;
+    for (std::unordered_map<std::string, BuiltinEntry>::const_iterator it = table.begin(); it != table.end(); it++)
     {
-        if (num_args > 2)
-        {
-            std::cerr << "smash error: listdir: too many arguments" << std::endl;
-            return;
-        }
+        result.push_back(it->first);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
 
-        const char *path = (num_args == 1) ? "." : args[1];
+void BuiltinsCommand::execute()
+{
+    std::vector<std::string> names = BuiltinRegistry::getInstance().names();
+    for (const std::string &name : names)
+    {
+        std::cout << name << std::endl;
+    }
+}
+REGISTER_PURE_BUILTIN("builtins", BuiltinsCommand);
 
-        DIR *dir = opendir(path);
-        if (!dir)
-        {
-            perror("smash error: opendir failed");
-            return;
-        }
+bool TextIsNumber(const char *text);
+
+enum ListDirOrder
+{
+    ListByName,
+    ListBySize, // largest first
+    ListByTime  // newest first
+};
 
-        std::vector<std::string> files;
-        std::vector<std::string> dirs;
-        std::vector<std::string> links;
+// An entry of the directory being listed, its name lives in the name arena
+struct ListDirEntry
+{
+    size_t name;
+    unsigned char type;
+    off_t size;
+    struct timespec mtime;
+};
+
+/**
+ * Reads the directory open on fd in listdir order: the files, then the
+ * directories, then the links, each group sorted by order (names break
+ * ties). The entries come in through large getdents64 calls into one name
+ * arena, only indices get sorted, and the lines are appended to listing.
+ * subdirs (if given) gets the names of the directories other than . and
+ * .., sorted by name.
+ */
+static void _listDirEntries(int fd, ListDirOrder order, std::string *listing, std::vector<std::string> *subdirs)
+{
+    static const size_t BUFFER_SIZE = 256 * 1024;
+    static thread_local std::vector<char> buffer(BUFFER_SIZE);
 
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != nullptr)
+    std::string names;
+    std::vector<ListDirEntry> entries;
+    while (true)
+    {
+        ssize_t got = getdents64(fd, buffer.data(), buffer.size());
+        if (got == -1 && errno == EINTR)
         {
-            std::string name(entry->d_name);
-            if (entry->d_type == DT_REG)
-            {
-                files.push_back("file: " + name);
-            }
-            else if (entry->d_type == DT_DIR)
-            {
-                dirs.push_back("directory: " + name);
-            }
-            else if (entry->d_type == DT_LNK)
-            {
-                links.push_back("link: " + name);
-            }
+            continue;
+        }
+        if (got == -1)
+        {
+            _perror("smash error: getdents64 failed");
+        }
+        if (got <= 0)
+        {
+            break;
+        }
+        for (ssize_t pos = 0; pos < got;)
+        {
+            struct dirent64 *record = reinterpret_cast<struct dirent64 *>(buffer.data() + pos);
+            ListDirEntry entry;
+            entry.name = names.size();
+            entry.type = record->d_type;
+            entry.size = 0;
+            entry.mtime.tv_sec = entry.mtime.tv_nsec = 0;
+            names.append(record->d_name);
+            names.push_back('\0');
+            entries.push_back(entry);
+            pos += record->d_reclen;
         }
-        closedir(dir);
+    }
 
-        std::sort(files.begin(), files.end());
-        std::sort(dirs.begin(), dirs.end());
-        std::sort(links.begin(), links.end());
+    // Some filesystems don't fill d_type, and the other orders need the
+    // metadata anyway. Resolved in one pass once the directory is read.
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        ListDirEntry &entry = entries[i];
+        if (entry.type != DT_UNKNOWN && order == ListByName)
+        {
+            continue;
+        }
+        struct stat info;
+        if (fstatat(fd, names.data() + entry.name, &info, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+            continue;
+        }
+        if (entry.type == DT_UNKNOWN)
+        {
+            entry.type = S_ISREG(info.st_mode) ? DT_REG : S_ISDIR(info.st_mode) ? DT_DIR
+                                                     : S_ISLNK(info.st_mode)   ? DT_LNK
+                                                                               : DT_UNKNOWN;
+        }
+        entry.size = info.st_size;
+        entry.mtime = info.st_mtim;
+    }
 
-        for (const std::string &file : files)
+    // (name, index) pairs are what gets sorted, a name compare then needs
+    // no trip through entries
+    typedef std::pair<const char *, size_t> SortKey;
+    const char *arena = names.data();
+    std::vector<SortKey> groups[3];
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        SortKey key(arena + entries[i].name, i);
+        if (entries[i].type == DT_REG)
         {
-            std::cout << file << std::endl;
+            groups[0].push_back(key);
         }
-        for (const std::string &dir : dirs)
+        else if (entries[i].type == DT_DIR)
         {
-            std::cout << dir << std::endl;
+            groups[1].push_back(key);
         }
-        for (const std::string &link : links)
+        else if (entries[i].type == DT_LNK)
         {
-            std::cout << link << std::endl;
+            groups[2].push_back(key);
         }
     }
-};
-class GetUserCommand : public Command
-{
-public:
-    GetUserCommand(const char *cmd_line) : Command(cmd_line) {}
-    void execute() override
+
+    auto by_name = [](const SortKey &a, const SortKey &b)
     {
-        if (num_args != 2)
+        return strcmp(a.first, b.first) < 0;
+    };
+    auto by_order = [&](const SortKey &a, const SortKey &b)
+    {
+        const ListDirEntry &x = entries[a.second];
+        const ListDirEntry &y = entries[b.second];
+        if (order == ListBySize && x.size != y.size)
         {
-            std::cerr << "smash error: getuser: too many arguments" << std::endl;
-            return;
+            return x.size > y.size;
+        }
+        if (order == ListByTime && (x.mtime.tv_sec != y.mtime.tv_sec || x.mtime.tv_nsec != y.mtime.tv_nsec))
+        {
+            return x.mtime.tv_sec != y.mtime.tv_sec ? x.mtime.tv_sec > y.mtime.tv_sec
+                                                    : x.mtime.tv_nsec > y.mtime.tv_nsec;
+        }
+        return by_name(a, b);
+    };
+
+    static const char *const prefixes[3] = {"file: ", "directory: ", "link: "};
+    listing->reserve(listing->size() + names.size() + entries.size() * 12);
+    for (int group = 0; group < 3; group++)
+    {
+        std::sort(groups[group].begin(), groups[group].end(), by_order);
+        for (size_t i = 0; i < groups[group].size(); i++)
+        {
+            listing->append(prefixes[group]);
+            listing->append(groups[group][i].first);
+            listing->push_back('\n');
         }
+    }
 
-        pid_t pid;
-        try
+    if (subdirs != nullptr)
+    {
+        if (order != ListByName)
         {
-            pid = std::stoi(args[1]);
+            std::sort(groups[1].begin(), groups[1].end(), by_name);
         }
-        catch (...)
+        for (size_t i = 0; i < groups[1].size(); i++)
         {
-            std::cerr << "smash error: getuser: process " << args[1] << " does not exist" << std::endl;
-            return;
+            const char *name = groups[1][i].first;
+            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+            {
+                subdirs->push_back(name);
+            }
         }
+    }
+}
 
-        // Get the process user and group
-        std::string proc_path = "/proc/" + std::to_string(pid) + "/status";
-        FILE *proc_file = fopen(proc_path.c_str(), "r");
-        if (!proc_file)
+// One directory of a listdir -R walk, filled in by whichever worker got it
+struct ListDirNode
+{
+    std::string path;
+    std::string name;
+    ListDirNode *parent;
+    // stays open until every child has opened itself relative to it
+    int fd;
+    std::atomic<int> references;
+    std::string listing;
+    std::vector<ListDirNode *> children; // sorted by name
+    std::string error;
+
+    ListDirNode(const std::string &path, const std::string &name, ListDirNode *parent)
+        : path(path), name(name), parent(parent), fd(-1), references(0) {}
+};
+
+// Walks a tree on a pool of threads. Every worker has its own deque: it
+// pushes the subdirectories it finds and pops from the back, idle workers
+// steal from the front of the others, and sleep while there is nothing
+// to steal. Directories are opened with openat relative to their parent's
+// fd, so no path is resolved twice.
+class DirectoryWalker
+{
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<ListDirNode *> tasks;
+    };
+    std::vector<Queue> queues;
+    std::atomic<long> outstanding; // queued or being visited
+    ListDirOrder order;
+    // idle workers wait for pushes (generation) or the end of the walk
+    std::mutex idle_lock;
+    std::condition_variable wakeup;
+    std::atomic<unsigned long> generation;
+
+    static void release(ListDirNode *node)
+    {
+        if (--node->references == 0)
         {
-            std::cerr << "smash error: getuser: process " << pid << " does not exist" << std::endl;
-            return;
+            close(node->fd);
+            node->fd = -1;
         }
+    }
 
-        char line[256];
-        uid_t uid = -1;
-        gid_t gid = -1;
-        while (fgets(line, sizeof(line), proc_file))
+    ListDirNode *next(size_t self)
+    {
         {
-            if (strncmp(line, "Uid:", 4) == 0)
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            if (!queues[self].tasks.empty())
             {
-                sscanf(line, "Uid: %u", &uid);
+                ListDirNode *node = queues[self].tasks.back();
+                queues[self].tasks.pop_back();
+                return node;
             }
-            if (strncmp(line, "Gid:", 4) == 0)
+        }
+        for (size_t k = 1; k < queues.size(); k++)
+        {
+            Queue &victim = queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
             {
-                sscanf(line, "Gid: %u", &gid);
+                ListDirNode *node = victim.tasks.front();
+                victim.tasks.pop_front();
+                return node;
             }
         }
-        fclose(proc_file);
+        return nullptr;
+    }
 
-        if (uid == (uid_t)-1 || gid == (gid_t)-1)
+    void visit(ListDirNode *node, size_t self)
+    {
+        int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+        int fd = (node->parent != nullptr) ? openat(node->parent->fd, node->name.c_str(), flags)
+                                           : open(node->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1 && errno == EMFILE)
+        {
+            // too many parents held open, the full path still works
+            fd = open(node->path.c_str(), flags);
+        }
+        if (node->parent != nullptr)
+        {
+            release(node->parent);
+        }
+        if (fd == -1)
         {
-            std::cerr << "smash error: getuser: process " << pid << " does not exist" << std::endl;
+            node->error = std::string("smash error: opendir failed: ") + strerror(errno);
+            done();
             return;
         }
+        node->fd = fd;
 
-        struct passwd *pwd = getpwuid(uid);
-        struct group *grp = getgrgid(gid);
-        if (!pwd || !grp)
+        std::vector<std::string> subdirs;
+        _listDirEntries(fd, order, &node->listing, &subdirs);
+        node->references = subdirs.size() + 1;
+        std::string prefix = node->path;
+        if (prefix.empty() || prefix[prefix.size() - 1] != '/')
         {
-            std::cerr << "smash error: getuser: process " << pid << " does not exist" << std::endl;
-            return;
+            prefix += '/';
+        }
+        for (size_t i = 0; i < subdirs.size(); i++)
+        {
+            node->children.push_back(new ListDirNode(prefix + subdirs[i], subdirs[i], node));
         }
 
-        std::cout << "User: " << pwd->pw_name << std::endl;
-        std::cout << "Group: " << grp->gr_name << std::endl;
+        outstanding += subdirs.size();
+        {
+            // reversed, so this worker goes on with the first one
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            for (size_t i = node->children.size(); i > 0; i--)
+            {
+                queues[self].tasks.push_back(node->children[i - 1]);
+            }
+        }
+        if (!subdirs.empty())
+        {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            generation++;
+            wakeup.notify_all();
+        }
+        release(node);
+        done();
     }
-};
 
-void SmallShell::executeCommand(const char *cmd_line)
-{
-    string cmd_str = string(cmd_line);
-    string original_cmd_str = cmd_str;
-
-    istringstream iss(cmd_str);
-    vector<string> args;
-    for (string s; iss >> s;)
+    // one node less to visit, the last one ends the walk for everybody
+    void done()
     {
-        args.push_back(s);
+        if (--outstanding == 0)
+        {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            wakeup.notify_all();
+        }
     }
 
-    if (args.empty())
+    void work(size_t self)
     {
-        return;
+        while (true)
+        {
+            // read before looking, a push we miss changes it
+            unsigned long seen = generation;
+            ListDirNode *node = next(self);
+            if (node != nullptr)
+            {
+                visit(node, self);
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(idle_lock);
+            wakeup.wait(guard, [&]() { return outstanding == 0 || generation != seen; });
+            if (outstanding == 0)
+            {
+                return;
+            }
+        }
     }
 
-    const string &command = args[0];
-
-    if (command == "alias")
-    {
-        handleAliasCommand(args, cmd_str);
-        return;
-    }
-    else if (command == "unalias")
-    {
-        handleUnaliasCommand(args);
-        return;
-    }
+public:
+    DirectoryWalker(unsigned workers, ListDirOrder order)
+        : queues(workers), outstanding(0), order(order), generation(0) {}
 
-    // Check if the command is an alias and substitute it
-    auto aliasIt = aliases.find(command);
-    if (aliasIt != aliases.end())
+    void walk(ListDirNode *root)
     {
-        string new_cmd_line = aliasIt->second;
-        for (size_t i = 1; i < args.size(); ++i)
+        outstanding = 1;
+        queues[0].tasks.push_back(root);
+        // the calling thread is worker 0
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < queues.size(); i++)
         {
-            new_cmd_line += " " + args[i];
+            pool.push_back(std::thread(&DirectoryWalker::work, this, i));
+        }
+        work(0);
+        for (size_t i = 0; i < pool.size(); i++)
+        {
+            pool[i].join();
         }
-        cmd_line = new_cmd_line.c_str();
     }
+};
 
-    Command *cmd = CreateCommand(cmd_line);
-    if (cmd != nullptr)
-    {
-        cmd->execute();
-    }
+/**
+ * listdir [-R [-j N]] [-S | -t] [path]
+ * Lists path, or with -R the whole tree below it, one "path:" block per
+ * directory in depth first, sorted order. The walk runs on N threads
+ * (default: one per core, at most 8), the output doesn't depend on N.
+ * -S sorts each group by size and -t by modification time instead of
+ * by name.
+ * #ListDirCommand
+ */
+class ListDirCommand : public Command
+{
+    static const unsigned MAX_WORKERS = 8;
+
+    void listRecursive(const char *path, unsigned workers, ListDirOrder order)
+    {
+        ListDirNode *root = new ListDirNode(path, path, nullptr);
+        DirectoryWalker walker(workers, order);
+        walker.walk(root);
+
+        // print depth first and free as we go
+        std::vector<ListDirNode *> stack(1, root);
+        bool first = true;
+        while (!stack.empty())
+        {
+            ListDirNode *node = stack.back();
+            stack.pop_back();
+            if (!node->error.empty())
+            {
+                std::cerr << node->error << std::endl;
+                delete node;
+                continue;
+            }
+            if (!first)
+            {
+                std::cout << std::endl;
+            }
+            first = false;
+            std::cout << node->path << ":" << std::endl;
+            std::cout.write(node->listing.data(), node->listing.size());
+            for (size_t i = node->children.size(); i > 0; i--)
+            {
+                stack.push_back(node->children[i - 1]);
+            }
+            delete node;
+        }
+    }
+
+public:
+    ListDirCommand(const char *cmd_line, TokenList lexed = TokenList()) : Command(cmd_line, lexed) {}
+    void execute() override
+    {
+        bool recursive = false;
+        ListDirOrder order = ListByName;
+        unsigned workers = std::thread::hardware_concurrency();
+        workers = (workers == 0 || workers > MAX_WORKERS) ? MAX_WORKERS : workers;
+        const char *path = nullptr;
+        for (int i = 1; i < num_args; i++)
+        {
+            if (strcmp(args[i], "-R") == 0)
+            {
+                recursive = true;
+            }
+            else if (strcmp(args[i], "-S") == 0)
+            {
+                order = ListBySize;
+            }
+            else if (strcmp(args[i], "-t") == 0)
+            {
+                order = ListByTime;
+            }
+            else if (strcmp(args[i], "-j") == 0)
+            {
+                if (i + 1 >= num_args || !TextIsNumber(args[i + 1]) || atoi(args[i + 1]) < 1)
+                {
+                    std::cerr << "smash error: listdir: invalid arguments" << std::endl;
+                    return;
+                }
+                workers = atoi(args[++i]);
+            }
+            else if (path == nullptr)
+            {
+                path = args[i];
+            }
+            else
+            {
+                std::cerr << "smash error: listdir: too many arguments" << std::endl;
+                return;
+            }
+        }
+        path = (path == nullptr) ? "." : path;
+
+        if (recursive)
+        {
+            listRecursive(path, workers, order);
+            return;
+        }
+
+        int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            _perror("smash error: opendir failed");
+            return;
+        }
+
+        // the whole listing goes out in one write
+        std::string listing;
+        _listDirEntries(fd, order, &listing, nullptr);
+        close(fd);
+        std::cout.write(listing.data(), listing.size());
+    }
+};
+REGISTER_PURE_BUILTIN("listdir", ListDirCommand);
+IdNameCache::IdNameCache()
+{
+    passwdMtime.tv_sec = passwdMtime.tv_nsec = 0;
+    groupMtime.tv_sec = groupMtime.tv_nsec = 0;
 }
 
-SmallShell::~SmallShell()
+static bool _mtimeChanged(const char *path, struct timespec *seen)
 {
-    // TODO: add your implementation
+    struct stat info;
+    if (stat(path, &info) == -1)
+    {
+        return true;
+    }
+    bool changed = info.st_mtim.tv_sec != seen->tv_sec || info.st_mtim.tv_nsec != seen->tv_nsec;
+    *seen = info.st_mtim;
+    return changed;
 }
 
-JobEntry::JobEntry(int jobID, pid_t PID, const char *command, time_t startTime, Command *cmnd,
-                   bool isStopped)
-    : PID(PID),
-      jobID(jobID),
-      command(command),
-      startTime(startTime),
-      cmnd(cmnd),
-      isStopped(isStopped)
+void IdNameCache::validate()
 {
-    if (_isBackgroundComamnd(this->command))
+    if (_mtimeChanged("/etc/passwd", &passwdMtime))
     {
-        isBackground = true;
+        users.clear();
     }
-    else
+    if (_mtimeChanged("/etc/group", &groupMtime))
     {
-        isBackground = false;
+        groups.clear();
     }
 }
 
-Command::Command(const char *cmd_line)
+// A missing name is cached as "" too
+bool IdNameCache::userName(uid_t uid, std::string *name)
 {
-    // this->cmd_line = cmd_line;  // original cmd_line
-    this->cmd_line = new char[strlen(cmd_line) + 1];
-    strcpy(this->cmd_line, cmd_line);
-
-    char **args = new char *[20];
-    char *cmd_line_local = new char[strlen(cmd_line) + 1];
-    strcpy(cmd_line_local, this->cmd_line);
-    _trim(cmd_line_local);
-    _removeBackgroundSign(cmd_line_local);
-
-    this->num_args = _parseCommandLine(cmd_line_local, args);
-
-    this->args = args;
+    std::unordered_map<unsigned, std::string>::iterator it = users.find(uid);
+    if (it == users.end())
+    {
+        struct passwd *pwd = getpwuid(uid);
+        it = users.insert(std::make_pair((unsigned)uid, std::string(pwd ? pwd->pw_name : ""))).first;
+    }
+    *name = it->second;
+    return !name->empty();
 }
 
-// BuiltInCommand::BuiltInCommand(const char* cmd_line) : Command(cmd_line) {
-//}
-
-Command::~Command()
+bool IdNameCache::groupName(gid_t gid, std::string *name)
 {
-    for (int i = 0; args[i] != nullptr; i++)
+    std::unordered_map<unsigned, std::string>::iterator it = groups.find(gid);
+    if (it == groups.end())
     {
-        free(args[i]);
-        args[i] = nullptr;
+        struct group *grp = getgrgid(gid);
+        it = groups.insert(std::make_pair((unsigned)gid, std::string(grp ? grp->gr_name : ""))).first;
     }
-    delete[] args;
-    args = nullptr;
+    *name = it->second;
+    return !name->empty();
 }
 
-ExternalCommand::ExternalCommand(const char *cmd_line) : Command(cmd_line) {}
-
-////////////////////////////////////////////////////////////////////////
-///                         Create Command                           ///
-////////////////////////////////////////////////////////////////////////
-
-/**
- * Creates and returns a pointer to Command class which matches the given
- * command line (cmd_line)
- * #CreateCommand
- */
-Command *SmallShell::CreateCommand(const char *cmd_line)
+// Reads the real uid and gid of pid from /proc/<pid>/status with a single
+// pread into a stack buffer, both lines are near the top of the file
+static bool _readProcessIds(pid_t pid, uid_t *uid, gid_t *gid)
 {
-
-    string cmd_s = _trim(string(cmd_line));
-    if (cmd_s.length() == 0)
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
     {
-        return nullptr;
+        return false;
     }
-    string firstWord = cmd_s.substr(0, cmd_s.find_first_of(" \n"));
-    if (firstWord[firstWord.size() - 1] == '&')
+    char buffer[4096];
+    ssize_t got;
+    do
+    {
+        got = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    } while (got == -1 && errno == EINTR);
+    close(fd);
+    if (got <= 0)
     {
-        firstWord.pop_back();
-    } // delete & connected to word
+        return false;
+    }
+    buffer[got] = '\0';
 
-    char *new_line = new char[strlen(cmd_line) + 1];
-    char **args = new char *[20];
-    strcpy(new_line, cmd_line);
-    _removeBackgroundSign(new_line);
-    int num_args = _parseCommandLine(new_line, args);
+    const char *uid_line = strstr(buffer, "\nUid:");
+    const char *gid_line = strstr(buffer, "\nGid:");
+    if (uid_line == nullptr || gid_line == nullptr)
+    {
+        return false;
+    }
+    *uid = strtoul(uid_line + 5, nullptr, 10);
+    *gid = strtoul(gid_line + 5, nullptr, 10);
+    return true;
+}
 
-    for (int i = 0; cmd_line[i] != '\0'; i++)
+/**
+ * getuser pid... | %all-jobs
+ * Prints the user and group owning each process. With more than one pid
+ * every answer is headed by its pid, %all-jobs stands for every job.
+ * #GetUserCommand
+ */
+class GetUserCommand : public Command
+{
+public:
+    GetUserCommand(const char *cmd_line, TokenList lexed = TokenList()) : Command(cmd_line, lexed) {}
+    void execute() override
     {
-        if (cmd_line[i] == '>' && cmd_line[i + 1] == '>')
-        {
-            return new RedirectionCommand(cmd_line, Append);
-        }
-        else if (cmd_line[i] == '>')
+        if (num_args < 2)
         {
-            return new RedirectionCommand(cmd_line, Override);
+            std::cerr << "smash error: getuser: too many arguments" << std::endl;
+            return;
         }
-        else if (cmd_line[i] == '|' && cmd_line[i + 1] == '&')
+
+        SmallShell &smash = SmallShell::getInstance();
+        std::vector<std::string> targets;
+        for (int i = 1; i < num_args; i++)
         {
-            return new PipeCommand(cmd_line, Fromstderr);
+            if (strcmp(args[i], "%all-jobs") == 0)
+            {
+                smash.jobsList->removeFinishedJobs();
+                std::map<int, JobEntry *> &jobs = smash.jobsList->jobsList->byID;
+                for (std::map<int, JobEntry *>::iterator it = jobs.begin(); it != jobs.end(); it++)
+                {
+                    targets.push_back(std::to_string(it->second->PID));
+                }
+            }
+            else
+            {
+                targets.push_back(args[i]);
+            }
         }
-        else if (cmd_line[i] == '|')
+
+        smash.idNames.validate();
+        bool headed = num_args > 2 || strcmp(args[1], "%all-jobs") == 0;
+        for (size_t i = 0; i < targets.size(); i++)
         {
-            return new PipeCommand(cmd_line, Fromstdout);
+            const char *text = targets[i].c_str();
+            char *end;
+            long pid = strtol(text, &end, 10);
+            uid_t uid;
+            gid_t gid;
+            std::string user;
+            std::string group;
+            if (end == text || *end != '\0' || pid <= 0 || !_readProcessIds(pid, &uid, &gid) ||
+                !smash.idNames.userName(uid, &user) || !smash.idNames.groupName(gid, &group))
+            {
+                std::cerr << "smash error: getuser: process " << text << " does not exist" << std::endl;
+                continue;
+            }
+
+            if (headed)
+            {
+                std::cout << pid << ":" << std::endl;
+            }
+            std::cout << "User: " << user << std::endl;
+            std::cout << "Group: " << group << std::endl;
         }
     }
+};
+REGISTER_PURE_BUILTIN("getuser", GetUserCommand);
 
-    // Check for built-in commands
-    if (firstWord.compare("chprompt") == 0)
+/**
+ * Lexes cmd_line, substitutes an alias in the first word and creates the
+ * matching Command, or returns nullptr for an empty line.
+ * #prepareCommand
+ */
+Command *SmallShell::prepareCommand(const char *cmd_line)
+{
+    // The line is lexed once here, the same tokens drive alias lookup,
+    // dispatch and the command's argv
+    CommandArena arena;
+    Token *tokens;
+    int num_tokens = _lexCommandLine(cmd_line, &tokens, &arena);
+    if (num_tokens == 0)
     {
-        return new ChangePromptCommand(cmd_line);
+        return nullptr;
     }
-    else if (firstWord.compare("showpid") == 0)
+
+    string new_cmd_line;
+    const AliasExpansion *expansion = nullptr;
+    if (tokens[0].type == TokenWord && !tokens[0].quoted)
     {
-        return new ShowPidCommand(cmd_line);
+        // Check if the command is an alias and substitute it
+        expansion = aliases.expand(tokens[0].text);
     }
-    else if (firstWord.compare("pwd") == 0)
+    if (expansion != nullptr)
     {
-        return new GetCurrDirCommand(cmd_line);
+        new_cmd_line = expansion->text + (cmd_line + tokens[0].end);
+        cmd_line = new_cmd_line.c_str();
+        if (expansion->splices)
+        {
+            // the alias comes lexed already, the rest of the line keeps its
+            // tokens shifted to their new place
+            int shift = (int)expansion->text.size() - tokens[0].end;
+            int count = (int)expansion->tokens.size() + num_tokens - 1;
+            Token *joined = static_cast<Token *>(arena.allocate((count > 0 ? count : 1) * sizeof(Token)));
+            std::copy(expansion->tokens.begin(), expansion->tokens.end(), joined);
+            for (int i = 1; i < num_tokens; i++)
+            {
+                Token &token = joined[expansion->tokens.size() + i - 1];
+                token = tokens[i];
+                token.start += shift;
+                token.end += shift;
+            }
+            tokens = joined;
+            num_tokens = count;
+        }
+        else
+        {
+            arena.reset();
+            num_tokens = _lexCommandLine(cmd_line, &tokens, &arena);
+        }
+        if (num_tokens == 0)
+        {
+            return nullptr;
+        }
     }
-    else if (firstWord.compare("cd") == 0)
+
+    return CreateCommand(cmd_line, TokenList(tokens, num_tokens));
+}
+
+// Writes out whatever the builtins left in the std::cout buffer. Needed
+// before anything else writes to fd 1: a child, a blocking wait, a fd swap.
+void SmallShell::flushOutput()
+{
+    output.flush();
+}
+
+void SmallShell::armTimeout(pid_t pid, const char *command, int seconds, int graceSeconds)
+{
+    long long deadline = (TimerWheel::nowMs() + seconds * 1000LL + TimerWheel::TICK_MS - 1) / TimerWheel::TICK_MS;
+    TimerEntry *entry = new TimerEntry(pid, command, deadline, graceSeconds * 1000);
+    cancelTimeout(pid);
+    timeouts[pid] = entry;
+    timers.add(entry);
+    rearmAlarm();
+}
+
+void SmallShell::cancelTimeout(pid_t pid)
+{
+    std::unordered_map<pid_t, TimerEntry *>::iterator it = timeouts.find(pid);
+    if (it == timeouts.end())
     {
-        return new ChangeDirCommand(cmd_line);
+        return;
     }
-    else if (firstWord.compare("jobs") == 0)
+    timers.cancel(it->second);
+    delete it->second;
+    timeouts.erase(it);
+    rearmAlarm();
+}
+
+// Points ITIMER_REAL at the next tick the wheel has work at
+void SmallShell::rearmAlarm()
+{
+    struct itimerval value;
+    memset(&value, 0, sizeof(value));
+    long long next = timers.nextExpiry();
+    if (next != -1)
     {
-        return new JobsCommand(cmd_line);
+        long long ms = next * TimerWheel::TICK_MS - TimerWheel::nowMs();
+        ms = (ms < 1) ? 1 : ms;
+        value.it_value.tv_sec = ms / 1000;
+        value.it_value.tv_usec = (ms % 1000) * 1000;
     }
-    else if (firstWord.compare("fg") == 0)
+    if (setitimer(ITIMER_REAL, &value, nullptr) == -1)
     {
-        return new ForegroundCommand(cmd_line);
+        _perror("smash error: setitimer failed");
     }
-    else if (firstWord.compare("bg") == 0)
+}
+
+// Runs outside of signal context once alarmHandler fired: sends the
+// signals for every expired timeout and re-arms the alarm.
+void SmallShell::handleAlarm()
+{
+    if (!alarmFired)
     {
-        return new BackgroundCommand(cmd_line);
+        return;
     }
-    else if (firstWord.compare("quit") == 0)
+    alarmFired = 0;
+
+    std::vector<TimerEntry *> expired;
+    timers.advance(TimerWheel::nowMs() / TimerWheel::TICK_MS, &expired);
+    if (!expired.empty())
     {
-        return new QuitCommand(cmd_line);
+        std::cout << "smash: got an alarm" << std::endl;
     }
-    else if (firstWord.compare("kill") == 0)
+    for (size_t i = 0; i < expired.size(); i++)
     {
-        return new KillCommand(cmd_line);
+        TimerEntry *entry = expired[i];
+        if (!entry->terminated)
+        {
+            std::cout << "smash: " << entry->command << " timed out!" << std::endl;
+        }
+        if (entry->graceMs > 0 && !entry->terminated)
+        {
+            // SIGTERM now, SIGKILL once the grace period is over
+            if (kill(entry->pid, SIGTERM) == -1)
+            {
+                _perror("smash error: kill failed");
+            }
+            entry->terminated = true;
+            entry->deadline = (TimerWheel::nowMs() + entry->graceMs) / TimerWheel::TICK_MS;
+            timers.add(entry);
+            continue;
+        }
+        if (kill(entry->pid, SIGKILL) == -1 && errno != ESRCH)
+        {
+            _perror("smash error: kill failed");
+        }
+        timeouts.erase(entry->pid);
+        delete entry;
     }
+    rearmAlarm();
+    flushOutput();
+}
 
-    // Check for special commands
-    else if (firstWord.compare("setcore") == 0)
-    {
-        return new SetcoreCommand(cmd_line);
-    }
-    else if (firstWord.compare("getfiletype") == 0)
+void SmallShell::executeCommand(const char *cmd_line)
+{
+    SMASH_PROBE(StatCommand);
+    // a script's lines are read without blocking, so signals that came in
+    // since the last command (finished jobs, timeouts) are handled here
+    dispatchSignals();
+    handleAlarm();
+    Command *cmd = prepareCommand(cmd_line);
+    if (cmd != nullptr)
     {
-        return new GetFileTypeCommand(cmd_line);
+        // builtins succeed unless they say otherwise, children report theirs
+        last_status = 0;
+        {
+            SMASH_PROBE_INTO(cmd->stats);
+            cmd->execute();
+        }
+        // a command that became a job lives on in the job list
+        if (!cmd->ownedByJob)
+        {
+            delete cmd;
+        }
     }
-    else if (firstWord.compare("chmod") == 0)
+}
+
+SmallShell::SmallShell()
+    : prompt("smash"), jobsList(new JobsList()), last_dir(""), eventDirectoryHasChanged(false),
+      shell_PID(getpid()), foreground_pid(-1), spawn_mode(SpawnPosix), commandHash(new CommandHash()),
+      pipe_capacity(0), output(STDOUT_FILENO, OutputBuffer::DEFAULT_CAPACITY),
+      errors(STDERR_FILENO, 0, &output), last_status(0), epoll_fd(-1), signal_fd(-1),
+      interrupt_requested(false), rusage_sink(nullptr)
+{
+    sigemptyset(&handled_signals);
+    output.install(std::cout);
+    errors.install(std::cerr);
+}
+
+void _perror(const char *message)
+{
+    int saved_errno = errno;
+    SmallShell::getInstance().flushOutput();
+    errno = saved_errno;
+    perror(message);
+}
+
+SmallShell::~SmallShell()
+{
+    // TODO: add your implementation
+}
+
+JobEntry::JobEntry(int jobID, pid_t PID, const char *command, time_t startTime, Command *cmnd,
+                   bool isStopped)
+    : PID(PID),
+      jobID(jobID),
+      command(command),
+      startTime(startTime),
+      cmnd(cmnd),
+      isStopped(isStopped),
+      startedAtMs(TimerWheel::nowMs()),
+      lastStatus(-1)
+{
+    memset(&usage, 0, sizeof(usage));
+    if (_isBackgroundComamnd(this->command))
     {
-        return new ChmodCommand(cmd_line);
+        isBackground = true;
     }
-    else if (firstWord.compare("timeout") == 0)
+    else
     {
-        return new TimeoutCommand(cmd_line);
+        isBackground = false;
     }
-    else if (firstWord.compare("listdir") == 0)
+}
+
+Command::Command(const char *cmd_line, TokenList lexed) : ownedByJob(false)
+{
+#ifdef SMASH_STATS
+    stats = nullptr;
+#endif
+    // The line copy, the tokens and argv all share the command's arena
+    size_t length = strlen(cmd_line);
+    this->cmd_line = arena.copyString(cmd_line, length);
+
+    if (lexed.count < 0)
     {
-        return new ListDirCommand(cmd_line);
+        num_tokens = _lexCommandLine(this->cmd_line, &tokens, &arena);
     }
-    else if (firstWord.compare("getuser") == 0)
+    else
     {
-        return new GetUserCommand(cmd_line);
+        // lexed by the caller already, keep a copy that lives as long as we do
+        num_tokens = lexed.count;
+        tokens = static_cast<Token *>(arena.allocate((num_tokens > 0 ? num_tokens : 1) * sizeof(Token)));
+        for (int i = 0; i < num_tokens; i++)
+        {
+            tokens[i] = lexed.tokens[i];
+            tokens[i].text = arena.copyString(lexed.tokens[i].text, strlen(lexed.tokens[i].text));
+        }
     }
 
-    // The Command is external
-    return new ExternalCommand(cmd_line);
+    this->num_args = _tokensToArgv(tokens, num_tokens, &this->args, &arena);
+}
 
-    return nullptr;
+// BuiltInCommand::BuiltInCommand(const char* cmd_line) : Command(cmd_line) {
+//}
+
+Command::~Command()
+{
+    // tokens and argv were never freed one by one, the arena goes at once
+    args = nullptr;
+    tokens = nullptr;
+    arena.reset();
 }
-////////////////////////////////////////////////////////////////////////
-///                        Built in Commands                         ///
-////////////////////////////////////////////////////////////////////////
+
+ExternalCommand::ExternalCommand(const char *cmd_line, TokenList lexed) : Command(cmd_line, lexed) {}
 
 ////////////////////////////////////////////////////////////////////////
-///                         ChangePrompt Command                     ///
+///                            #OutputBuffer                         ///
 ////////////////////////////////////////////////////////////////////////
-void ChangePromptCommand::execute()
-{
-    SmallShell &smash = SmallShell::getInstance();
 
-    if (!args[1])
+OutputBuffer::OutputBuffer(int fd, size_t capacity, OutputBuffer *before)
+    : fd(fd), before(before), buffer(capacity), replaced(nullptr), installedOn(nullptr)
+{
+    if (capacity > 0)
     {
-        smash.prompt = "smash";
-        return;
+        setp(buffer.data(), buffer.data() + capacity);
     }
-    smash.prompt = args[1];
 }
 
-////////////////////////////////////////////////////////////////////////
-///                         ShowPid Command                          ///
-////////////////////////////////////////////////////////////////////////
-void ShowPidCommand::execute()
+OutputBuffer::~OutputBuffer()
 {
+    flush();
+    // the stream outlives us, give it back its own buffer
+    if (installedOn != nullptr && installedOn->rdbuf() == this)
+    {
+        installedOn->rdbuf(replaced);
+    }
+}
 
-    SmallShell &smash = SmallShell::getInstance();
-    std::cout << "smash pid is " << smash.shell_PID << std::endl;
+void OutputBuffer::install(std::ostream &stream)
+{
+    replaced = stream.rdbuf(this);
+    installedOn = &stream;
 }
 
-////////////////////////////////////////////////////////////////////////
-///                    GetCurrDir Command                            ///
-////////////////////////////////////////////////////////////////////////
-void GetCurrDirCommand::execute() { std::cout << getcwd(NULL, 0) << std::endl; }
+bool OutputBuffer::writeAll(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // nobody reads fd any more (EPIPE) or it is gone, drop the rest
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
 
-////////////////////////////////////////////////////////////////////////
-///                    ChangeDir Command                             ///
-////////////////////////////////////////////////////////////////////////
-void ChangeDirCommand::execute()
+void OutputBuffer::flush()
 {
-    SmallShell &smash = SmallShell::getInstance();
-    std::string last_dir_local = getcwd(NULL, 0); // use only in case of change
-    // Error Handling
-    if (args[2] != nullptr)
+    if (pbase() == pptr())
     {
-        std::cerr << "smash error: cd: too many arguments" << std::endl;
-        return;
-    }
-    if (args[1] == nullptr)
-    {
-        return;
-    }
-    if (strcmp(this->args[1], "..") == 0)
-    {
-        // Find the last / and cut it
-        std::string curr_dir = getcwd(NULL, 0);
-        // curr_dir += "/";
-        size_t index = curr_dir.find_last_of("/");
-
-        if (index == std::string::npos)
-        {
-            // path is illegal, How did we get here?
-            return;
-        }
-        curr_dir = curr_dir.substr(0, index);
-        if (index == 0)
-        {
-            // case where curr is /home
-            curr_dir = '/';
-        }
-        if (chdir(curr_dir.c_str()) != 0)
-        {
-            // chdir Failed
-            perror("smash error: chdir failed");
-            return;
-        }
-        else
-        {
-            smash.last_dir = last_dir_local;
-        }
-        smash.eventDirectoryHasChanged = true;
         return;
     }
+    writeAll(pbase(), pptr() - pbase());
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
 
-    if (strcmp(this->args[1], "-") == 0)
+OutputBuffer::int_type OutputBuffer::overflow(int_type ch)
+{
+    if (buffer.empty())
     {
-        if (smash.eventDirectoryHasChanged == false)
-        {
-            std::cerr << "smash error: cd: OLDPWD not set" << std::endl;
-            return;
-        }
-        std::string set_to_this = smash.last_dir;
-        if (chdir(set_to_this.c_str()) != 0)
-        {
-            // chdir Failed
-            perror("smash error: chdir failed");
-            return;
-        }
-        else
+        if (before != nullptr)
         {
-            smash.last_dir = last_dir_local;
+            before->flush();
         }
-        smash.eventDirectoryHasChanged = true;
-        return;
+        char c = traits_type::to_char_type(ch);
+        return (ch == traits_type::eof() || writeAll(&c, 1)) ? traits_type::not_eof(ch) : traits_type::eof();
     }
 
-    // Normal path given.
-    if (chdir(args[1]) != 0)
-    {
-        // chdir Failed
-        perror("smash error: chdir failed");
-        return;
-    }
-    else
+    flush();
+    if (ch != traits_type::eof())
     {
-        smash.last_dir = last_dir_local;
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
     }
-    smash.eventDirectoryHasChanged = true;
+    return traits_type::not_eof(ch);
 }
 
-////////////////////////////////////////////////////////////////////////
-///                             Jobs                                 ///
-////////////////////////////////////////////////////////////////////////
-
-void JobsList::removeFinishedJobs()
+std::streamsize OutputBuffer::xsputn(const char *data, std::streamsize size)
 {
-    if (!this->jobsList)
-    {
-        return;
-    }
-    if (this->jobsList->empty())
+    if (size <= epptr() - pptr())
     {
-        this->maxJobID = 1;
-        return;
+        memcpy(pptr(), data, size);
+        pbump(size);
+        return size;
     }
 
-    int stat_loc;
-    for (std::list<JobEntry *>::iterator it = this->jobsList->begin(); it != this->jobsList->end(); it++)
+    // does not fit: empty the buffer, then either buffer it or, when it is
+    // larger than the whole buffer, write it out directly
+    if (before != nullptr)
     {
-        int pid = (*it)->PID;
-        if (waitpid((*it)->PID, &stat_loc, WNOHANG) > 0 || kill(pid, 0) == -1)
-        {
-            delete (*it)->cmnd;
-            it = this->jobsList->erase(it);
-        }
+        before->flush();
     }
-    int new_max_id = 0;
-    for (JobEntry *entry : *this->jobsList)
+    flush();
+    if ((size_t)size < buffer.size())
     {
-        if (entry->jobID > new_max_id)
-        {
-            new_max_id = entry->jobID;
-        }
+        memcpy(pptr(), data, size);
+        pbump(size);
+        return size;
     }
-    this->maxJobID = new_max_id + 1;
+    return writeAll(data, size) ? size : 0;
 }
 
-void JobsList::addJob(Command *cmd, pid_t job_pid, bool isStopped)
+// std::endl and std::flush land here, they no longer cost a write(2)
+int OutputBuffer::sync()
 {
-    removeFinishedJobs();
-
-    time_t time_of_start = time(nullptr);
-    if (time_of_start == -1)
-    {
-        perror("smash error: time failed");
-        return;
-    }
-
-    JobEntry *entry = new JobEntry(maxJobID, job_pid, cmd->cmd_line,
-                                   time_of_start, cmd, isStopped);
-    this->jobsList->push_back(entry);
-    this->maxJobID++;
+    return 0;
 }
 
-void JobsList::killAllJobs()
+////////////////////////////////////////////////////////////////////////
+///                             #TimerWheel                          ///
+////////////////////////////////////////////////////////////////////////
+
+TimerWheel::TimerWheel() : current(nowMs() / TICK_MS), count(0)
 {
-    SmallShell &smash = SmallShell::getInstance();
-    smash.jobsList->removeFinishedJobs();
-    for (JobEntry *entry : *jobsList)
+    for (int level = 0; level < LEVELS; level++)
     {
-        if (kill(entry->PID, SIGKILL) == -1)
+        for (int slot = 0; slot < SLOTS; slot++)
         {
-            perror("smash error: kill failed");
+            slots[level][slot] = nullptr;
         }
-        else
-        {
-            delete entry;
-        }
-    }
-    maxJobID = 1;
-    for (std::list<JobEntry *>::iterator it = this->jobsList->begin(); it != this->jobsList->end(); it++)
-    {
-        delete (*it)->cmnd;
-        it = this->jobsList->erase(it);
     }
-    jobsList->clear();
 }
-void JobsList::printJobsList()
-{
-    removeFinishedJobs();
-    for (JobEntry *entry : *jobsList)
-    {
-        std::cout << "[" << entry->jobID << "] " << entry->command;
 
-        if (entry->isStopped)
-        {
-            std::cout << " (stopped)" << std::endl;
-        }
-        else
-        {
-            std::cout << std::endl;
-        }
-    }
+long long TimerWheel::nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
-JobEntry *JobsList::getJobById(int jobId)
+// Links entry into the slot its deadline falls in, seen from current: the
+// finest level whose span still reaches the deadline.
+void TimerWheel::place(TimerEntry *entry)
 {
-    SmallShell &smash = SmallShell::getInstance();
-    smash.jobsList->removeFinishedJobs();
-    auto it = std::find_if(
-        jobsList->begin(), jobsList->end(),
-        [jobId](const JobEntry *entry)
-        { return entry->jobID == jobId; });
-    if (it == jobsList->end())
+    long long delta = entry->deadline - current;
+    long long tick = entry->deadline;
+    if (delta < 0)
     {
-        // Job doesn't exist
-        return nullptr;
+        delta = 0;
+        tick = current;
     }
-    else
+    if (delta >= (1LL << (SLOT_BITS * LEVELS)))
     {
-        return *it;
+        // further out than the wheel spans, parked and placed again later
+        tick = current + (1LL << (SLOT_BITS * LEVELS)) - 1;
+        delta = tick - current;
     }
-}
-
-JobEntry *JobsList::getJobByPID(int PID)
-{
-    SmallShell &smash = SmallShell::getInstance();
-    smash.jobsList->removeFinishedJobs();
-    auto it = std::find_if(
-        jobsList->begin(), jobsList->end(),
-        [PID](const JobEntry *entry)
-        { return entry->PID == PID; });
-    if (it == jobsList->end())
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1LL << (SLOT_BITS * (level + 1))))
     {
-        // Job doesn't exist
-        return nullptr;
+        level++;
     }
-    else
+
+    TimerEntry **head = &slots[level][(tick >> (SLOT_BITS * level)) & (SLOTS - 1)];
+    entry->head = head;
+    entry->prev = nullptr;
+    entry->next = *head;
+    if (*head != nullptr)
     {
-        return *it;
+        (*head)->prev = entry;
     }
+    *head = entry;
 }
 
-void JobsList::removeJobById(int jobId)
+void TimerWheel::unlink(TimerEntry *entry)
 {
-    SmallShell &smash = SmallShell::getInstance();
-    auto it = std::remove_if(
-        jobsList->begin(), jobsList->end(),
-        [jobId](const JobEntry *entry)
-        { return entry->jobID == jobId; });
-    if (it == jobsList->end())
+    if (entry->prev != nullptr)
     {
-        return;
+        entry->prev->next = entry->next;
     }
-    if (*it)
+    else
     {
-        jobsList->erase(it);
-        // delete *it; // todo without?
+        *entry->head = entry->next;
     }
-
-    //    for (std::list<JobEntry*>::iterator it= this->jobsList->begin(); it != this->jobsList->end(); it++){
-    //        if (jobId == (*it)->jobID) {
-    //            delete (*it)->cmnd;
-    //            it = this->jobsList->erase(it);
-    //        }
-    //    }
-}
-JobEntry *JobsList::getLastJob(int *lastJobId)
-{
-    SmallShell &smash = SmallShell::getInstance();
-    smash.jobsList->removeFinishedJobs();
-    if (this->jobsList->empty())
+    if (entry->next != nullptr)
     {
-        *lastJobId = -1; // Failure - No jobs
-        return nullptr;
+        entry->next->prev = entry->prev;
     }
-    return jobsList->back();
+    entry->prev = entry->next = nullptr;
+    entry->head = nullptr;
 }
 
-JobEntry *JobsList::getLastStoppedJob(int *jobId)
+void TimerWheel::add(TimerEntry *entry)
 {
-    SmallShell &smash = SmallShell::getInstance();
-    smash.jobsList->removeFinishedJobs();
-    auto it = std::find_if(
-        jobsList->rbegin(), jobsList->rend(),
-        [jobId](const JobEntry *entry)
-        { return entry->isStopped; });
-    if (it == jobsList->rend())
+    long long now = nowMs() / TICK_MS;
+    if (count == 0 && current < now)
     {
-        return nullptr;
+        // nothing was armed, no reason to walk the idle ticks later
+        current = now;
     }
-    else
+    if (entry->deadline <= current)
     {
-        return *it;
+        entry->deadline = current + 1;
     }
+    place(entry);
+    count++;
 }
 
-void JobsCommand::execute()
+void TimerWheel::cancel(TimerEntry *entry)
 {
-    SmallShell &smash = SmallShell::getInstance();
-    smash.jobsList->removeFinishedJobs();
-    smash.jobsList->printJobsList();
-    smash.jobsList->removeFinishedJobs();
+    if (entry->head == nullptr)
+    {
+        return;
+    }
+    unlink(entry);
+    count--;
 }
 
-////////////////////////////////////////////////////////////////////////
-///                       BackgroundCommand                          ///
-////////////////////////////////////////////////////////////////////////
-
-void ::BackgroundCommand::execute()
+void TimerWheel::advance(long long now, std::vector<TimerEntry *> *expired)
 {
-    SmallShell &smash = SmallShell::getInstance();
-    smash.jobsList->removeFinishedJobs();
-
-    /// no arguments
-    if (num_args == 1)
+    while (current < now)
     {
-        int job_ID;
-
-        if (smash.jobsList->getLastStoppedJob(&job_ID) == nullptr)
+        if (count == 0)
         {
-            std::cerr << "smash error: bg: there is no stopped jobs to resume"
-                      << endl;
-            return;
+            current = now;
+            break;
         }
+        current++;
 
-        JobEntry *my_job = smash.jobsList->getLastStoppedJob(&job_ID);
-
-        cout << my_job->command << " " << my_job->PID << endl;
+        // the coarser levels whose next slot starts at this tick go first,
+        // their timers end up in the finer levels below
+        for (int level = LEVELS - 1; level > 0; level--)
+        {
+            if ((current & ((1LL << (SLOT_BITS * level)) - 1)) != 0)
+            {
+                continue;
+            }
+            TimerEntry **head = &slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+            TimerEntry *entry = *head;
+            *head = nullptr;
+            while (entry != nullptr)
+            {
+                TimerEntry *following = entry->next;
+                place(entry);
+                entry = following;
+            }
+        }
 
-        if (kill(my_job->PID, SIGCONT) == -1)
+        TimerEntry *entry = slots[0][current & (SLOTS - 1)];
+        while (entry != nullptr)
         {
-            perror("smash error: kill failed");
-            return;
+            TimerEntry *following = entry->next;
+            if (entry->deadline <= current)
+            {
+                unlink(entry);
+                count--;
+                expired->push_back(entry);
+            }
+            entry = following;
         }
-        my_job->isStopped = false;
-        my_job->isBackground = true;
-        return;
     }
-    /// with arguments
-
-    int jobID;
+}
 
-    try
+long long TimerWheel::nextExpiry() const
+{
+    if (count == 0)
     {
-        jobID = stoi((args[1]));
+        return -1;
     }
-    catch (...)
+    // the first non-empty slot of each level after the current one, a
+    // coarse level only has work when its slot cascades. Above level 0 a
+    // deadline can be a full turn ahead, in the slot current is in.
+    long long next = -1;
+    for (int level = 0; level < LEVELS; level++)
     {
-        std::cerr << "smash error: bg: invalid arguments" << endl;
-        return;
+        long long base = current >> (SLOT_BITS * level);
+        long long last = (level == 0) ? SLOTS - 1 : SLOTS;
+        for (long long k = 1; k <= last; k++)
+        {
+            if (slots[level][(base + k) & (SLOTS - 1)] != nullptr)
+            {
+                long long tick = (base + k) << (SLOT_BITS * level);
+                if (next == -1 || tick < next)
+                {
+                    next = tick;
+                }
+                break;
+            }
+        }
     }
+    return next;
+}
 
-    JobEntry *my_job = smash.jobsList->getJobById(jobID);
+////////////////////////////////////////////////////////////////////////
+///                              #EventLoop                          ///
+////////////////////////////////////////////////////////////////////////
 
-    if (my_job == nullptr)
+// Blocks the signals smash handles and starts reading them from a
+// signalfd instead. From here on the handlers in signals.cpp only run from
+// dispatchSignals, never in signal context.
+bool SmallShell::startEventLoop()
+{
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGINT);
+    sigaddset(&handled_signals, SIGTSTP);
+    sigaddset(&handled_signals, SIGCHLD);
+    sigaddset(&handled_signals, SIGALRM);
+    if (sigprocmask(SIG_BLOCK, &handled_signals, nullptr) == -1)
     {
-        cerr << "smash error: bg: job-id " << jobID << " does not exist"
-             << endl;
-        return;
+        _perror("smash error: sigprocmask failed");
+        return false;
     }
 
-    if (my_job->isStopped == false)
+    signal_fd = signalfd(-1, &handled_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1)
     {
-        cerr << "smash error: bg: job-id " << jobID
-             << " is already running in the background" << endl;
-        return;
+        _perror("smash error: signalfd failed");
+        return false;
     }
-
-    if (num_args >= 3)
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
     {
-        std::cerr << "smash error: bg: invalid arguments" << endl;
-        return;
+        _perror("smash error: epoll_create failed");
+        return false;
     }
-
-    cout << my_job->command << " " << my_job->PID << endl;
-
-    if (kill(my_job->PID, SIGCONT) == -1)
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = signal_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1)
     {
-        perror("smash error: kill failed");
-        return;
+        _perror("smash error: epoll_ctl failed");
+        close(epoll_fd);
+        epoll_fd = -1;
+        return false;
     }
-
-    my_job->isBackground = true;
-    my_job->isStopped = false;
+    return true;
 }
 
-////////////////////////////////////////////////////////////////////////
-///                             QuitCommand                          ///
-////////////////////////////////////////////////////////////////////////
-void QuitCommand::execute()
+// For a forked child that keeps running smash code: the epoll instance is
+// shared with the parent, so it must not be touched, and the signals go
+// back to their defaults.
+void SmallShell::leaveEventLoop()
 {
-
-    SmallShell &smash = SmallShell::getInstance();
-    smash.jobsList->removeFinishedJobs();
-    if (num_args == 1)
+    if (epoll_fd != -1)
     {
-        exit(0);
+        close(epoll_fd);
+        epoll_fd = -1;
     }
-
-    if (strcmp(args[1], "kill") != 0)
-    { // #cont
-        exit(0);
+    if (signal_fd != -1)
+    {
+        close(signal_fd);
+        signal_fd = -1;
     }
-    // print before killing
+    sigprocmask(SIG_UNBLOCK, &handled_signals, nullptr);
+}
 
-    int counter = 0;
-    for (JobEntry *entry : *smash.jobsList->jobsList)
+// Runs the handler of every signal queued on signal_fd
+void SmallShell::dispatchSignals()
+{
+    if (signal_fd == -1)
     {
-        counter++;
+        return;
     }
-    std::cout << "smash: sending SIGKILL signal to " << counter << " jobs:" << std::endl;
-    for (JobEntry *entry : *smash.jobsList->jobsList)
+    struct signalfd_siginfo info[8];
+    while (true)
     {
-        std::cout << entry->PID << entry->command << std::endl;
+        ssize_t got = read(signal_fd, info, sizeof(info));
+        if (got == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            // EAGAIN, nothing left
+            return;
+        }
+        for (size_t i = 0; i < got / sizeof(info[0]); i++)
+        {
+            switch (info[i].ssi_signo)
+            {
+            case SIGINT:
+                ctrlCHandler(SIGINT);
+                break;
+            case SIGTSTP:
+                ctrlZHandler(SIGTSTP);
+                break;
+            case SIGCHLD:
+                childHandler(SIGCHLD);
+                break;
+            case SIGALRM:
+                alarmHandler(SIGALRM);
+                break;
+            }
+        }
     }
-    // std::cout << std::endl;
-    smash.jobsList->killAllJobs();
-    exit(0);
 }
 
-////////////////////////////////////////////////////////////////////////
-///                       ForegroundCommand                          ///
-////////////////////////////////////////////////////////////////////////
-void ForegroundCommand::execute()
+/**
+ * The one place smash blocks: waits until fd is readable (fd -1 waits for
+ * signals only), at most timeout_ms when that is not -1, and handles every
+ * signal that arrives in the meantime. Returns true once fd is readable,
+ * false when it only handled signals or timed out.
+ * Regular files cannot be polled (EPERM) and always count as readable.
+ * #pollEvents
+ */
+bool SmallShell::pollEvents(int fd, int timeout_ms)
+{
+    if (epoll_fd == -1)
+    {
+        // no event loop, the caller blocks on its own
+        if (fd == -1 && timeout_ms > 0)
+        {
+            usleep(timeout_ms * 1000);
+        }
+        return true;
+    }
+
+    bool watching = false;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    if (fd != -1)
+    {
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0)
+        {
+            watching = true;
+        }
+        else if (errno == EPERM)
+        {
+            // nothing to wait for, but what arrived meanwhile is still due
+            dispatchSignals();
+            handleAlarm();
+            return true;
+        }
+        else
+        {
+            _perror("smash error: epoll_ctl failed");
+            return true;
+        }
+    }
+
+    flushOutput();
+    bool readable = false;
+    struct epoll_event ready[2];
+    int count;
+    do
+    {
+        count = epoll_wait(epoll_fd, ready, 2, timeout_ms);
+    } while (count == -1 && errno == EINTR);
+    if (count == -1)
+    {
+        _perror("smash error: epoll_wait failed");
+        readable = true;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (ready[i].data.fd == signal_fd)
+        {
+            dispatchSignals();
+        }
+        else if (ready[i].data.fd == fd)
+        {
+            readable = true;
+        }
+    }
+
+    if (watching && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &event) == -1)
+    {
+        _perror("smash error: epoll_ctl failed");
+    }
+    handleAlarm();
+    flushOutput();
+    return readable;
+}
+
+////////////////////////////////////////////////////////////////////////
+///                             #LineReader                          ///
+////////////////////////////////////////////////////////////////////////
+
+bool LineReader::readLine(std::string *line)
+{
+    line->clear();
+    while (true)
+    {
+        char *begin = buffer.data() + start;
+        char *newline = static_cast<char *>(memchr(begin, '\n', end - start));
+        if (newline != nullptr)
+        {
+            line->append(begin, newline - begin);
+            start += (newline - begin) + 1;
+            return true;
+        }
+
+        // no full line buffered, keep the partial one and read the next block
+        line->append(begin, end - start);
+        start = end = 0;
+        if (eof)
+        {
+            return !line->empty();
+        }
+        // signals (ctrl-C at the prompt, timeouts, finished jobs) are
+        // handled while we wait for input
+        if (!SmallShell::getInstance().pollEvents(fd))
+        {
+            continue;
+        }
+        ssize_t got = read(fd, buffer.data(), buffer.size());
+        if (got == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            if (got == -1)
+            {
+                _perror("smash error: read failed");
+            }
+            eof = true;
+            continue;
+        }
+        end = got;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+///                         Create Command                           ///
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * Creates and returns a pointer to Command class which matches the given
+ * command line (cmd_line)
+ * #CreateCommand
+ */
+Command *SmallShell::CreateCommand(const char *cmd_line)
+{
+    CommandArena arena;
+    Token *tokens;
+    int num_tokens = _lexCommandLine(cmd_line, &tokens, &arena);
+    return CreateCommand(cmd_line, TokenList(tokens, num_tokens));
+}
+
+Command *SmallShell::CreateCommand(const char *cmd_line, TokenList lexed)
+{
+    SMASH_PROBE(StatDispatch);
+    if (lexed.count <= 0)
+    {
+        return nullptr;
+    }
+
+    // time is a keyword, as in bash: it covers the whole pipeline or
+    // redirection after it, the operators on the line are its business
+    bool keyword = lexed.tokens[0].type == TokenWord && !lexed.tokens[0].quoted &&
+                   strcmp(lexed.tokens[0].text, "time") == 0;
+
+    // the first operator on the line decides, quoted ones were never lexed
+    // as operators
+    for (int i = 0; i < lexed.count && !keyword; i++)
+    {
+        switch (lexed.tokens[i].type)
+        {
+        case TokenAppend:
+            return new RedirectionCommand(cmd_line, Append, lexed);
+        case TokenRedirect:
+            return new RedirectionCommand(cmd_line, Override, lexed);
+        case TokenPipeErr:
+            return new PipeCommand(cmd_line, Fromstderr, lexed);
+        case TokenPipe:
+            return new PipeCommand(cmd_line, Fromstdout, lexed);
+        default:
+            break;
+        }
+    }
+
+    if (lexed.tokens[0].type != TokenWord)
+    {
+        return new ExternalCommand(cmd_line, lexed);
+    }
+    string firstWord = lexed.tokens[0].text;
+
+    // Check for built-in commands
+    CommandFactory builtin = BuiltinRegistry::getInstance().find(firstWord);
+    if (builtin != nullptr)
+    {
+        Command *cmd = builtin(cmd_line, lexed);
+#ifdef SMASH_STATS
+        cmd->stats = BuiltinRegistry::getInstance().statsFor(firstWord);
+#endif
+        return cmd;
+    }
+
+    // The Command is external
+    return new ExternalCommand(cmd_line, lexed);
+}
+////////////////////////////////////////////////////////////////////////
+///                        Built in Commands                         ///
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+///                         ChangePrompt Command                     ///
+////////////////////////////////////////////////////////////////////////
+void ChangePromptCommand::execute()
+{
+    SmallShell &smash = SmallShell::getInstance();
+
+    if (!args[1])
+    {
+        smash.prompt = "smash";
+        return;
+    }
+    smash.prompt = args[1];
+}
+REGISTER_BUILTIN("chprompt", ChangePromptCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                         ShowPid Command                          ///
+////////////////////////////////////////////////////////////////////////
+void ShowPidCommand::execute()
+{
+
+    SmallShell &smash = SmallShell::getInstance();
+    std::cout << "smash pid is " << smash.shell_PID << std::endl;
+}
+REGISTER_PURE_BUILTIN("showpid", ShowPidCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                    GetCurrDir Command                            ///
+////////////////////////////////////////////////////////////////////////
+void GetCurrDirCommand::execute() { std::cout << getcwd(NULL, 0) << std::endl; }
+REGISTER_PURE_BUILTIN("pwd", GetCurrDirCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                    ChangeDir Command                             ///
+////////////////////////////////////////////////////////////////////////
+void ChangeDirCommand::execute()
+{
+    SmallShell &smash = SmallShell::getInstance();
+    std::string last_dir_local = getcwd(NULL, 0); // use only in case of change
+    // Error Handling
+    if (args[2] != nullptr)
+    {
+        std::cerr << "smash error: cd: too many arguments" << std::endl;
+        return;
+    }
+    if (args[1] == nullptr)
+    {
+        return;
+    }
+    if (strcmp(this->args[1], "..") == 0)
+    {
+        // Find the last / and cut it
+        std::string curr_dir = getcwd(NULL, 0);
+        // curr_dir += "/";
+        size_t index = curr_dir.find_last_of("/");
+
+        if (index == std::string::npos)
+        {
+            // path is illegal, How did we get here?
+            return;
+        }
+        curr_dir = curr_dir.substr(0, index);
+        if (index == 0)
+        {
+            // case where curr is /home
+            curr_dir = '/';
+        }
+        if (chdir(curr_dir.c_str()) != 0)
+        {
+            // chdir Failed
+            _perror("smash error: chdir failed");
+            return;
+        }
+        else
+        {
+            smash.last_dir = last_dir_local;
+        }
+        smash.eventDirectoryHasChanged = true;
+        return;
+    }
+
+    if (strcmp(this->args[1], "-") == 0)
+    {
+        if (smash.eventDirectoryHasChanged == false)
+        {
+            std::cerr << "smash error: cd: OLDPWD not set" << std::endl;
+            return;
+        }
+        std::string set_to_this = smash.last_dir;
+        if (chdir(set_to_this.c_str()) != 0)
+        {
+            // chdir Failed
+            _perror("smash error: chdir failed");
+            return;
+        }
+        else
+        {
+            smash.last_dir = last_dir_local;
+        }
+        smash.eventDirectoryHasChanged = true;
+        return;
+    }
+
+    // Normal path given.
+    if (chdir(args[1]) != 0)
+    {
+        // chdir Failed
+        _perror("smash error: chdir failed");
+        return;
+    }
+    else
+    {
+        smash.last_dir = last_dir_local;
+    }
+    smash.eventDirectoryHasChanged = true;
+}
+REGISTER_BUILTIN("cd", ChangeDirCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                             Jobs                                 ///
+////////////////////////////////////////////////////////////////////////
+
+JobPool::~JobPool()
+{
+    // live entries were destroyed by JobStack::clear
+    for (char *chunk : chunks)
+    {
+        ::operator delete(chunk);
+    }
+}
+
+JobEntry *JobPool::allocate(int jobID, pid_t PID, const char *command, time_t startTime, Command *cmnd,
+                            bool isStopped)
+{
+    if (freeList.empty())
+    {
+        char *chunk = static_cast<char *>(::operator new(CHUNK_ENTRIES * sizeof(JobEntry)));
+        chunks.push_back(chunk);
+        for (size_t i = CHUNK_ENTRIES; i > 0; i--)
+        {
+            freeList.push_back(reinterpret_cast<JobEntry *>(chunk + (i - 1) * sizeof(JobEntry)));
+        }
+    }
+    JobEntry *slot = freeList.back();
+    freeList.pop_back();
+    return new (slot) JobEntry(jobID, PID, command, startTime, cmnd, isStopped);
+}
+
+void JobPool::release(JobEntry *entry)
+{
+    entry->~JobEntry();
+    freeList.push_back(entry);
+}
+
+JobEntry *JobStack::insert(int jobID, pid_t PID, const char *command, time_t startTime, Command *cmnd,
+                           bool isStopped)
+{
+    JobEntry *entry = pool.allocate(jobID, PID, command, startTime, cmnd, isStopped);
+    byID[jobID] = entry;
+    byPID[PID] = entry;
+    if (isStopped)
+    {
+        stoppedIDs.insert(jobID);
+    }
+    return entry;
+}
+
+void JobStack::erase(JobEntry *entry)
+{
+    byID.erase(entry->jobID);
+    byPID.erase(entry->PID);
+    stoppedIDs.erase(entry->jobID);
+    pool.release(entry);
+}
+
+void JobStack::setStopped(JobEntry *entry, bool isStopped)
+{
+    entry->isStopped = isStopped;
+    if (isStopped)
+    {
+        stoppedIDs.insert(entry->jobID);
+    }
+    else
+    {
+        stoppedIDs.erase(entry->jobID);
+    }
+}
+
+JobEntry *JobStack::findById(int jobID)
+{
+    std::map<int, JobEntry *>::iterator it = byID.find(jobID);
+    return it == byID.end() ? nullptr : it->second;
+}
+
+JobEntry *JobStack::findByPID(pid_t PID)
+{
+    std::unordered_map<pid_t, JobEntry *>::iterator it = byPID.find(PID);
+    return it == byPID.end() ? nullptr : it->second;
+}
+
+void JobStack::clear()
+{
+    for (std::map<int, JobEntry *>::iterator it = byID.begin(); it != byID.end(); it++)
+    {
+        pool.release(it->second);
+    }
+    byID.clear();
+    byPID.clear();
+    stoppedIDs.clear();
+}
+
+/**
+ * Applies the state changes of children that SIGCHLD reported since the
+ * last call. Without a pending SIGCHLD the job list is left untouched, so
+ * calling this before every lookup costs nothing.
+ * #removeFinishedJobs
+ */
+void JobsList::removeFinishedJobs()
+{
+    if (!this->jobsList || !childStateChanged)
+    {
+        return;
+    }
+    // clear before reaping, a child that changes state from here on raises
+    // the flag again
+    childStateChanged = 0;
+
+    bool removed = false;
+    int stat_loc;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &stat_loc, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+    {
+        if (!WIFSTOPPED(stat_loc) && !WIFCONTINUED(stat_loc))
+        {
+            // gone, its pid may be reused, a pending timeout must not fire
+            SmallShell::getInstance().cancelTimeout(pid);
+        }
+        JobEntry *entry = jobsList->findByPID(pid);
+        if (entry == nullptr)
+        {
+            if (abandonedPIDs.erase(pid) == 0 && !WIFSTOPPED(stat_loc) && !WIFCONTINUED(stat_loc))
+            {
+                ChildReport report = {stat_loc, usage};
+                reapedChildren[pid] = report;
+            }
+            continue;
+        }
+        entry->lastStatus = stat_loc;
+        entry->usage = usage;
+        if (WIFSTOPPED(stat_loc))
+        {
+            jobsList->setStopped(entry, true);
+        }
+        else if (WIFCONTINUED(stat_loc))
+        {
+            jobsList->setStopped(entry, false);
+        }
+        else
+        {
+            delete entry->cmnd;
+            jobsList->erase(entry);
+            removed = true;
+        }
+    }
+
+    if (removed)
+    {
+        updateMaxJobID();
+    }
+}
+
+void JobsList::updateMaxJobID()
+{
+    this->maxJobID = jobsList->empty() ? 1 : jobsList->byID.rbegin()->first + 1;
+}
+
+void JobsList::setStopped(JobEntry *entry, bool isStopped)
+{
+    jobsList->setStopped(entry, isStopped);
+}
+
+// Hands out the status of a child that removeFinishedJobs reaped on behalf
+// of someone blocked in waitpid for it.
+bool JobsList::takeReapedStatus(pid_t pid, int *status, struct rusage *usage)
+{
+    std::map<pid_t, ChildReport>::iterator it = reapedChildren.find(pid);
+    if (it == reapedChildren.end())
+    {
+        return false;
+    }
+    if (status)
+    {
+        *status = it->second.status;
+    }
+    if (usage)
+    {
+        *usage = it->second.usage;
+    }
+    reapedChildren.erase(it);
+    return true;
+}
+
+// Shell style exit status: the exit code, or 128 + the signal that killed
+// or stopped the child
+int _exitStatusOf(int status)
+{
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status))
+    {
+        return 128 + WSTOPSIG(status);
+    }
+    return 0;
+}
+
+// Adds what one more child used, the way time reports a pipeline
+static void _addRusage(struct rusage *total, const struct rusage &more)
+{
+    timeradd(&total->ru_utime, &more.ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &more.ru_stime, &total->ru_stime);
+    total->ru_maxrss = (more.ru_maxrss > total->ru_maxrss) ? more.ru_maxrss : total->ru_maxrss;
+    total->ru_nvcsw += more.ru_nvcsw;
+    total->ru_nivcsw += more.ru_nivcsw;
+}
+
+// wait4 for a specific child, which may already have been reaped by
+// removeFinishedJobs through wait4(-1). Blocking waits go through the
+// event loop, so ctrl-C, ctrl-Z and timeouts are handled while we wait.
+// The status and rusage also go to the child's job, if it has one.
+pid_t _waitChild(pid_t pid, int *status, int options, struct rusage *usage = nullptr)
+{
+    SMASH_PROBE(StatWait);
+    SmallShell &smash = SmallShell::getInstance();
+    bool foreground = (smash.foreground_pid == pid);
+    int child_status = 0;
+    struct rusage child_usage;
+    memset(&child_usage, 0, sizeof(child_usage));
+    bool reported = true; // child_status and child_usage came from wait4
+    pid_t res;
+    while (true)
+    {
+        smash.handleAlarm();
+        if ((options & WNOHANG) || !smash.eventLoopRunning())
+        {
+            smash.flushOutput();
+            res = wait4(pid, &child_status, options, &child_usage);
+            if (res == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        res = wait4(pid, &child_status, options | WNOHANG, &child_usage);
+        if (res != 0)
+        {
+            break;
+        }
+        JobEntry *job = smash.jobsList->getJobByPID(pid);
+        if (foreground && smash.foreground_pid != pid && job != nullptr && job->isStopped)
+        {
+            // ctrl-Z stopped it and moved it to the job list, its stop
+            // report may already be consumed by removeFinishedJobs
+            child_status = W_STOPCODE(SIGTSTP);
+            reported = false;
+            res = pid;
+            break;
+        }
+        smash.pollEvents(-1);
+    }
+
+    if (res == -1 && errno == ECHILD && smash.jobsList->takeReapedStatus(pid, &child_status, &child_usage))
+    {
+        res = pid;
+    }
+    if (res != pid)
+    {
+        return res;
+    }
+
+    if (!WIFSTOPPED(child_status))
+    {
+        smash.cancelTimeout(pid);
+        if (smash.rusage_sink != nullptr)
+        {
+            _addRusage(smash.rusage_sink, child_usage);
+        }
+    }
+    JobEntry *job = smash.jobsList->getJobByPID(pid);
+    if (job != nullptr && reported)
+    {
+        job->lastStatus = child_status;
+        job->usage = child_usage;
+    }
+    if (status)
+    {
+        *status = child_status;
+    }
+    if (usage)
+    {
+        *usage = child_usage;
+    }
+    return res;
+}
+
+void JobsList::addJob(Command *cmd, pid_t job_pid, bool isStopped)
+{
+    removeFinishedJobs();
+
+    time_t time_of_start = time(nullptr);
+    if (time_of_start == -1)
+    {
+        _perror("smash error: time failed");
+        return;
+    }
+
+    this->jobsList->insert(maxJobID, job_pid, cmd->cmd_line, time_of_start, cmd, isStopped);
+    cmd->ownedByJob = true;
+    this->maxJobID++;
+}
+
+void JobsList::killAllJobs()
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+    for (std::map<int, JobEntry *>::iterator it = jobsList->byID.begin(); it != jobsList->byID.end(); it++)
+    {
+        if (kill(it->second->PID, SIGKILL) == -1)
+        {
+            _perror("smash error: kill failed");
+        }
+        delete it->second->cmnd;
+    }
+    maxJobID = 1;
+    jobsList->clear();
+}
+// A wait status in words, for jobs -l
+static std::string _describeStatus(int status)
+{
+    if (status == -1)
+    {
+        return "running";
+    }
+    if (WIFEXITED(status))
+    {
+        return "exited " + std::to_string(WEXITSTATUS(status));
+    }
+    if (WIFSIGNALED(status))
+    {
+        return "killed by signal " + std::to_string(WTERMSIG(status));
+    }
+    if (WIFSTOPPED(status))
+    {
+        return "stopped by signal " + std::to_string(WSTOPSIG(status));
+    }
+    return "continued";
+}
+
+void JobsList::printJobsList(bool details)
+{
+    removeFinishedJobs();
+    for (std::map<int, JobEntry *>::iterator it = jobsList->byID.begin(); it != jobsList->byID.end(); it++)
+    {
+        JobEntry *entry = it->second;
+        std::cout << "[" << entry->jobID << "] " << entry->command;
+
+        // jobs started by timeout show their deadline, or that it passed and
+        // they are in the -k grace period
+        SmallShell &smash = SmallShell::getInstance();
+        std::unordered_map<pid_t, TimerEntry *>::const_iterator timer = smash.timeouts.find(entry->PID);
+        if (timer != smash.timeouts.end() && timer->second->terminated)
+        {
+            std::cout << " (timed out)";
+        }
+        else if (timer != smash.timeouts.end())
+        {
+            long long left_ms = timer->second->deadline * TimerWheel::TICK_MS - TimerWheel::nowMs();
+            std::cout << " (timeout in " << (left_ms > 0 ? (left_ms + 500) / 1000 : 0) << "s)";
+        }
+
+        if (entry->isStopped)
+        {
+            std::cout << " (stopped)" << std::endl;
+        }
+        else
+        {
+            std::cout << std::endl;
+        }
+
+        if (details)
+        {
+            // usage is as of the last report, a job that never stopped has none yet
+            const struct rusage &usage = entry->usage;
+            char line[256];
+            snprintf(line, sizeof(line),
+                     "    pid %d, %s, user %ld.%03lds, sys %ld.%03lds, maxrss %ld KB, csw %ld/%ld, wall %.1fs",
+                     (int)entry->PID, _describeStatus(entry->lastStatus).c_str(), (long)usage.ru_utime.tv_sec,
+                     (long)usage.ru_utime.tv_usec / 1000, (long)usage.ru_stime.tv_sec,
+                     (long)usage.ru_stime.tv_usec / 1000, usage.ru_maxrss, usage.ru_nvcsw, usage.ru_nivcsw,
+                     (TimerWheel::nowMs() - entry->startedAtMs) / 1000.0);
+            std::cout << line << std::endl;
+        }
+    }
+}
+
+JobEntry *JobsList::getJobById(int jobId)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+    return jobsList->findById(jobId);
+}
+
+JobEntry *JobsList::getJobByPID(int PID)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+    return jobsList->findByPID(PID);
+}
+
+void JobsList::removeJobById(int jobId)
+{
+    JobEntry *entry = jobsList->findById(jobId);
+    if (entry == nullptr)
+    {
+        return;
+    }
+    delete entry->cmnd;
+    jobsList->erase(entry);
+    updateMaxJobID();
+}
+JobEntry *JobsList::getLastJob(int *lastJobId)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+    if (this->jobsList->empty())
+    {
+        *lastJobId = -1; // Failure - No jobs
+        return nullptr;
+    }
+    return jobsList->byID.rbegin()->second;
+}
+
+JobEntry *JobsList::getLastStoppedJob(int *jobId)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+    if (jobsList->stoppedIDs.empty())
+    {
+        return nullptr;
+    }
+    return jobsList->findById(*jobsList->stoppedIDs.rbegin());
+}
+
+void JobsCommand::execute()
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+    smash.jobsList->printJobsList(num_args > 1 && strcmp(args[1], "-l") == 0);
+    smash.jobsList->removeFinishedJobs();
+}
+REGISTER_PURE_BUILTIN("jobs", JobsCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                       BackgroundCommand                          ///
+////////////////////////////////////////////////////////////////////////
+
+void ::BackgroundCommand::execute()
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+
+    /// no arguments
+    if (num_args == 1)
+    {
+        int job_ID;
+
+        if (smash.jobsList->getLastStoppedJob(&job_ID) == nullptr)
+        {
+            std::cerr << "smash error: bg: there is no stopped jobs to resume"
+                      << endl;
+            return;
+        }
+
+        JobEntry *my_job = smash.jobsList->getLastStoppedJob(&job_ID);
+
+        cout << my_job->command << " " << my_job->PID << endl;
+
+        if (kill(my_job->PID, SIGCONT) == -1)
+        {
+            _perror("smash error: kill failed");
+            return;
+        }
+        smash.jobsList->setStopped(my_job, false);
+        my_job->isBackground = true;
+        return;
+    }
+    /// with arguments
+
+    int jobID;
+
+    try
+    {
+        jobID = stoi((args[1]));
+    }
+    catch (...)
+    {
+        std::cerr << "smash error: bg: invalid arguments" << endl;
+        return;
+    }
+
+    JobEntry *my_job = smash.jobsList->getJobById(jobID);
+
+    if (my_job == nullptr)
+    {
+        cerr << "smash error: bg: job-id " << jobID << " does not exist"
+             << endl;
+        return;
+    }
+
+    if (my_job->isStopped == false)
+    {
+        cerr << "smash error: bg: job-id " << jobID
+             << " is already running in the background" << endl;
+        return;
+    }
+
+    if (num_args >= 3)
+    {
+        std::cerr << "smash error: bg: invalid arguments" << endl;
+        return;
+    }
+
+    cout << my_job->command << " " << my_job->PID << endl;
+
+    if (kill(my_job->PID, SIGCONT) == -1)
+    {
+        _perror("smash error: kill failed");
+        return;
+    }
+
+    my_job->isBackground = true;
+    smash.jobsList->setStopped(my_job, false);
+}
+REGISTER_BUILTIN("bg", BackgroundCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                             QuitCommand                          ///
+////////////////////////////////////////////////////////////////////////
+void QuitCommand::execute()
+{
+
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+    smash.flushOutput();
+    if (num_args == 1)
+    {
+        exit(0);
+    }
+
+    if (strcmp(args[1], "kill") != 0)
+    { // #cont
+        exit(0);
+    }
+    // print before killing
+
+    std::map<int, JobEntry *> &jobs = smash.jobsList->jobsList->byID;
+    std::cout << "smash: sending SIGKILL signal to " << jobs.size() << " jobs:" << std::endl;
+    for (std::map<int, JobEntry *>::iterator it = jobs.begin(); it != jobs.end(); it++)
+    {
+        std::cout << it->second->PID << it->second->command << std::endl;
+    }
+    // std::cout << std::endl;
+    smash.jobsList->killAllJobs();
+    smash.flushOutput();
+    exit(0);
+}
+REGISTER_BUILTIN("quit", QuitCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                       ForegroundCommand                          ///
+////////////////////////////////////////////////////////////////////////
+void ForegroundCommand::execute()
+{
+
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+
+    if (num_args == 1)
+    {
+        int job_ID;
+
+        if (smash.jobsList->getLastJob(&job_ID) == nullptr)
+        {
+            std::cerr << "smash error: fg: jobs list is empty"
+                      << endl;
+            return;
+        }
+
+        JobEntry *my_job = smash.jobsList->getLastJob(&job_ID);
+
+        // Cont. job in case it has been stopped
+        if (my_job->isStopped)
+        {
+            if (kill(my_job->PID, SIGCONT) == -1)
+            {
+                _perror("smash error: kill failed");
+                return;
+            }
+            smash.jobsList->setStopped(my_job, false);
+        }
+        cout << my_job->command << " " << my_job->PID << endl;
+
+        smash.UpdateForeground(my_job->cmnd, my_job->PID);
+        int temp_pid = my_job->PID;
+        int job_id = my_job->jobID;
+        int status;
+
+        if (_waitChild(temp_pid, &status, WUNTRACED) == temp_pid)
+        {
+            smash.last_status = _exitStatusOf(status);
+            if (!WIFSTOPPED(status))
+            {
+                // reaped here, SIGCHLD will not report it to the job list
+                smash.jobsList->removeJobById(job_id);
+            }
+        }
+
+        smash.UpdateForeground(nullptr, -1);
+        smash.jobsList->removeFinishedJobs();
+        return;
+    }
+
+    int jobID;
+
+    try
+    {
+        jobID = stoi((args[1]));
+    }
+    catch (...)
+    {
+        std::cerr << "smash error: fg: invalid arguments" << endl;
+        return;
+    }
+
+    JobEntry *my_job = smash.jobsList->getJobById(jobID);
+
+    if (my_job == nullptr)
+    {
+        cerr << "smash error: fg: job-id " << jobID << " does not exist"
+             << endl;
+        return;
+    }
+
+    if (num_args >= 3)
+    {
+        std::cerr << "smash error: fg: invalid arguments" << endl;
+        return;
+    }
+
+    // Cont. job in case it has been stopped
+    if (my_job->isStopped)
+    {
+        if (kill(my_job->PID, SIGCONT) == -1)
+        {
+            _perror("smash error: kill failed");
+            return;
+        }
+        smash.jobsList->setStopped(my_job, false);
+    }
+
+    cout << my_job->command << " " << my_job->PID << endl;
+
+    smash.UpdateForeground(my_job->cmnd, my_job->PID);
+    int temp_pid = my_job->PID;
+    int job_id = my_job->jobID;
+    int status;
+
+    if (_waitChild(temp_pid, &status, WUNTRACED) == temp_pid)
+    {
+        smash.last_status = _exitStatusOf(status);
+        if (!WIFSTOPPED(status))
+        {
+            // reaped here, SIGCHLD will not report it to the job list
+            smash.jobsList->removeJobById(job_id);
+        }
+    }
+    smash.UpdateForeground(nullptr, -1);
+    smash.jobsList->removeFinishedJobs();
+}
+REGISTER_BUILTIN("fg", ForegroundCommand);
+
+/**
+ * timeout [-k grace] duration command
+ * Runs command and kills it once duration seconds have passed: SIGKILL
+ * right away, or SIGTERM followed by SIGKILL grace seconds later. Any
+ * number of timeouts can be pending, they all share SmallShell::timers.
+ * #TimeoutCommand
+ */
+void TimeoutCommand::execute()
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+
+    int grace = 0;
+    int next = 1;
+    if (args[next] != nullptr && strcmp(args[next], "-k") == 0)
+    {
+        if (args[next + 1] == nullptr || !TextIsNumber(args[next + 1]))
+        {
+            cerr << "smash error: timeout: invalid arguments" << endl;
+            return;
+        }
+        grace = atoi(args[next + 1]);
+        next += 2;
+    }
+    if (args[next] == nullptr || !TextIsNumber(args[next]) || args[next + 1] == nullptr)
+    {
+        cerr << "smash error: timeout: invalid arguments" << endl;
+        return;
+    }
+    int duration = atoi(args[next]);
+
+    // args[] are the words, so the command starts at word next + 1
+    int word = 0;
+    const char *inner_line = nullptr;
+    for (int i = 0; i < num_tokens && inner_line == nullptr; i++)
+    {
+        if (tokens[i].type == TokenWord && word++ == next + 1)
+        {
+            inner_line = cmd_line + tokens[i].start;
+        }
+    }
+    if (inner_line == nullptr)
+    {
+        cerr << "smash error: timeout: invalid arguments" << endl;
+        return;
+    }
+
+    Command *inner = smash.prepareCommand(inner_line);
+    if (inner == nullptr)
+    {
+        return;
+    }
+    ExternalCommand *external = dynamic_cast<ExternalCommand *>(inner);
+    if (external == nullptr)
+    {
+        // builtins, pipelines and redirections don't leave a single child
+        // behind that the timer could kill, they just run
+        inner->execute();
+        if (!inner->ownedByJob)
+        {
+            delete inner;
+        }
+        return;
+    }
+
+    pid_t pid = external->spawn();
+    delete inner;
+    if (pid == -1)
+    {
+        smash.last_status = 127;
+        return;
+    }
+    smash.armTimeout(pid, cmd_line, duration, grace);
+
+    if (_isBackgroundComamnd(cmd_line))
+    {
+        smash.jobsList->addJob(this, pid);
+        return;
+    }
+
+    smash.UpdateForeground(this, pid);
+    int status;
+    if (_waitChild(pid, &status, WUNTRACED) == pid)
+    {
+        smash.last_status = _exitStatusOf(status);
+    }
+    smash.UpdateForeground(nullptr, -1);
+    smash.jobsList->removeFinishedJobs();
+}
+REGISTER_BUILTIN("timeout", TimeoutCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                           KillCommand                            ///
+////////////////////////////////////////////////////////////////////////
+
+void KillCommand::execute()
+{ /// remember to ask if checking the validity of
+  /// jobID is always necessary!! (not only here
+  /// but everywhere)
+
+    SmallShell &smash = SmallShell::getInstance();
+    smash.jobsList->removeFinishedJobs();
+
+    std::string jobNumStr;
+    int jobID;
+    try
+    {
+        jobNumStr = std::string(args[2]);
+        jobID = stoi(jobNumStr);
+    }
+    catch (...)
+    {
+        std::cerr << "smash error: kill: invalid arguments" << endl;
+        return;
+    }
+
+    if (!TextIsNumber(jobNumStr.c_str()))
+    {
+        std::cerr << "smash error: kill: invalid arguments" << endl;
+        return;
+    }
+
+    JobEntry *my_job = smash.jobsList->getJobById(jobID);
+    if (my_job == nullptr)
+    {
+        cerr << "smash error: kill: job-id " << jobID << " does not exist"
+             << endl;
+        return;
+    }
+
+    std::string numStr = std::string(args[1]).substr(1);
+
+    int sigNum;
+    try
+    {
+        sigNum = stoi(numStr);
+    }
+    catch (...)
+    {
+        std::cerr << "smash error: kill: invalid arguments" << endl;
+        return;
+    }
+
+    if (num_args !=
+        3)
+    { // make sure that this is enough, rather than checking if #<3
+        std::cerr << "smash error: kill: invalid arguments" << endl;
+        return;
+    }
+
+    char *sig_num_string = new char[strlen(args[1]) + 1];
+    strcpy(sig_num_string, args[1]);
+    if (sig_num_string[0] != '-')
+    {
+        std::cerr << "smash error: kill: invalid arguments" << endl;
+        return;
+    }
+
+    sig_num_string = sig_num_string + 1;
+    if (!TextIsNumber(sig_num_string))
+    {
+        std::cerr << "smash error: kill: invalid arguments" << endl;
+        return;
+    }
+
+    pid_t pid = my_job->PID;
+    switch (sigNum)
+    {
+    case SIGSTOP:
+        smash.jobsList->setStopped(my_job, true);
+        break;
+    case SIGCONT:
+        smash.jobsList->setStopped(my_job, false);
+        break;
+    }
+    if (kill(my_job->PID, sigNum) == -1)
+    {
+        _perror("smash error: kill failed");
+        return;
+    }
+    smash.jobsList->removeFinishedJobs();
+    if (sigNum == SIGKILL && smash.jobsList->getJobByPID(pid) != nullptr)
+    {
+        // the zombie is reaped later through SIGCHLD, don't report it then
+        smash.jobsList->abandonedPIDs.insert(pid);
+        smash.jobsList->removeJobById(my_job->jobID);
+    }
+    std::cout << "signal number " << sigNum << " was sent to pid " << pid << std::endl;
+}
+REGISTER_BUILTIN("kill", KillCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                         #External Commands                       ///
+////////////////////////////////////////////////////////////////////////
+
+void SmallShell::UpdateForeground(Command *command, pid_t pid)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.foreground_command = command;
+    smash.foreground_pid = pid;
+}
+
+extern char **environ;
+
+/**
+ * Launches file (resolved through $PATH) as a new process in its own process
+ * group. fd_in/fd_out/fd_err, when not -1, become the child's stdin, stdout
+ * and stderr. Returns the child's pid, or -1 after printing an error.
+ * #spawnProcess
+ */
+pid_t SmallShell::spawnProcess(const char *file, char *const argv[], int fd_in, int fd_out, int fd_err)
+{
+    SMASH_PROBE(StatSpawn);
+    const int redirect[3] = {fd_in, fd_out, fd_err};
+
+    // Resolve through the hash table so an unknown command fails here,
+    // without paying for a child.
+    std::string path(file);
+    if (path.find('/') == std::string::npos && !commandHash->lookup(path, &path))
+    {
+        errno = ENOENT;
+        _perror("smash error: execvp failed");
+        return -1;
+    }
+
+    // a forked child would inherit (and later repeat) pending output
+    flushOutput();
+    if (spawn_mode == SpawnFork)
+    {
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            _perror("smash error: fork failed");
+            return -1;
+        }
+        if (pid == 0)
+        { // Child Process
+            setpgrp();
+            sigprocmask(SIG_UNBLOCK, &handled_signals, nullptr);
+            for (int fd = 0; fd < 3; fd++)
+            {
+                if (redirect[fd] != -1 && dup2(redirect[fd], fd) == -1)
+                {
+                    _perror("smash error: dup2 failed");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (execv(path.c_str(), argv) == -1)
+            {
+                _perror("smash error: execvp failed");
+                exit(EXIT_FAILURE);
+            }
+            exit(EXIT_SUCCESS);
+        }
+        return pid;
+    }
+
+    // posix_spawn never touches our page tables, the child runs on our
+    // memory until it execs. setpgroup(0) is the equivalent of setpgrp().
+    // The signals the event loop reads are blocked in smash, the child gets
+    // them unblocked.
+    posix_spawnattr_t attr;
+    short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    sigset_t child_mask;
+    sigprocmask(SIG_SETMASK, nullptr, &child_mask);
+    for (int sig = 1; sig < NSIG; sig++)
+    {
+        if (sigismember(&handled_signals, sig) == 1)
+        {
+            sigdelset(&child_mask, sig);
+        }
+    }
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, flags);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigmask(&attr, &child_mask);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int fd = 0; fd < 3; fd++)
+    {
+        if (redirect[fd] != -1)
+        {
+            posix_spawn_file_actions_adddup2(&actions, redirect[fd], fd);
+        }
+    }
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path.c_str(), &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0)
+    {
+        errno = err;
+        _perror("smash error: execvp failed");
+        return -1;
+    }
+    return pid;
+}
+
+////////////////////////////////////////////////////////////////////////
+///                         #CommandHash                             ///
+////////////////////////////////////////////////////////////////////////
+
+static bool _sameMtime(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Re-split $PATH whenever it differs from the one the table was built for
+void CommandHash::syncPath()
+{
+    const char *env_path = getenv("PATH");
+    std::string current = env_path ? env_path : "/bin:/usr/bin";
+    if (current == cachedPath && !dirs.empty())
+    {
+        return;
+    }
+    table.clear();
+    dirs.clear();
+    dirMtimes.clear();
+    cachedPath = current;
+
+    size_t start = 0;
+    while (true)
+    {
+        size_t end = current.find(':', start);
+        std::string dir = current.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        // an empty PATH element means the current directory
+        dirs.push_back(dir.empty() ? "." : dir);
+        struct stat dir_info;
+        struct timespec mtime = {0, 0};
+        if (stat(dirs.back().c_str(), &dir_info) == 0)
+        {
+            mtime = dir_info.st_mtim;
+        }
+        dirMtimes.push_back(mtime);
+        if (end == std::string::npos)
+        {
+            break;
+        }
+        start = end + 1;
+    }
+}
+
+// Checks directories [0, upTo] against their recorded mtimes, refreshing
+// the recorded value of any directory that changed.
+bool CommandHash::dirsUnchanged(size_t upTo)
+{
+    bool unchanged = true;
+    for (size_t i = 0; i <= upTo && i < dirs.size(); i++)
+    {
+        struct stat dir_info;
+        struct timespec mtime = {0, 0};
+        if (stat(dirs[i].c_str(), &dir_info) == 0)
+        {
+            mtime = dir_info.st_mtim;
+        }
+        if (!_sameMtime(mtime, dirMtimes[i]))
+        {
+            dirMtimes[i] = mtime;
+            unchanged = false;
+        }
+    }
+    return unchanged;
+}
+
+bool CommandHash::search(const std::string &name, HashEntry *entry)
+{
+    for (size_t i = 0; i < dirs.size(); i++)
+    {
+        std::string candidate = dirs[i] + "/" + name;
+        struct stat file_info;
+        if (stat(candidate.c_str(), &file_info) == 0 && !S_ISDIR(file_info.st_mode) &&
+            access(candidate.c_str(), X_OK) == 0)
+        {
+            entry->path = candidate;
+            entry->dirIndex = i;
+            entry->hits = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CommandHash::lookup(const std::string &name, std::string *path)
+{
+    syncPath();
+    std::map<std::string, HashEntry>::iterator it = table.find(name);
+    if (it != table.end())
+    {
+        if (dirsUnchanged(it->second.dirIndex))
+        {
+            it->second.hits++;
+            *path = it->second.path;
+            return true;
+        }
+        // something was added or removed on the way to the hit, every
+        // entry below that directory may be stale
+        table.clear();
+    }
+
+    HashEntry entry;
+    if (!search(name, &entry))
+    {
+        return false;
+    }
+    entry.hits = 1;
+    table[name] = entry;
+    *path = entry.path;
+    return true;
+}
+
+bool CommandHash::warm(const std::string &name)
+{
+    syncPath();
+    HashEntry entry;
+    if (!search(name, &entry))
+    {
+        return false;
+    }
+    table[name] = entry;
+    return true;
+}
+
+void CommandHash::clear()
+{
+    table.clear();
+}
+
+void CommandHash::printTable()
+{
+    syncPath();
+    if (table.empty())
+    {
+        std::cout << "smash: hash table empty" << std::endl;
+        return;
+    }
+    std::cout << "hits\tcommand" << std::endl;
+    for (std::map<std::string, HashEntry>::iterator it = table.begin(); it != table.end(); it++)
+    {
+        std::cout << std::setw(4) << it->second.hits << "\t" << it->second.path << std::endl;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+///                            #HashCommand                          ///
+////////////////////////////////////////////////////////////////////////
+
+void HashCommand::execute()
+{
+    SmallShell &smash = SmallShell::getInstance();
+    if (num_args == 1)
+    {
+        smash.commandHash->printTable();
+        return;
+    }
+    if (strcmp(args[1], "-r") == 0)
+    {
+        if (num_args != 2)
+        {
+            std::cerr << "smash error: hash: invalid arguments" << std::endl;
+            return;
+        }
+        smash.commandHash->clear();
+        return;
+    }
+    for (int i = 1; i < num_args; i++)
+    {
+        if (!smash.commandHash->warm(args[i]))
+        {
+            std::cerr << "smash error: hash: " << args[i] << ": not found" << std::endl;
+        }
+    }
+}
+REGISTER_BUILTIN("hash", HashCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                         #Expansion                               ///
+////////////////////////////////////////////////////////////////////////
+
+// Finds the '}' closing the '{' at open, and whether a top level ',' is in
+// between (bash leaves braces without a comma alone).
+static size_t _matchingBrace(const std::string &word, size_t open, bool *hasComma)
+{
+    int depth = 0;
+    *hasComma = false;
+    for (size_t i = open; i < word.size(); i++)
+    {
+        if (word[i] == '{')
+        {
+            depth++;
+        }
+        else if (word[i] == '}')
+        {
+            if (--depth == 0)
+            {
+                return i;
+            }
+        }
+        else if (word[i] == ',' && depth == 1)
+        {
+            *hasComma = true;
+        }
+    }
+    return std::string::npos;
+}
+
+// a{b,c{d,e}}f -> abf acdf acef, in order
+void _expandBraces(const std::string &word, std::vector<std::string> *out)
+{
+    for (size_t open = word.find('{'); open != std::string::npos; open = word.find('{', open + 1))
+    {
+        bool hasComma;
+        size_t close = _matchingBrace(word, open, &hasComma);
+        if (close == std::string::npos)
+        {
+            break;
+        }
+        if (!hasComma)
+        {
+            continue;
+        }
+        std::string prefix = word.substr(0, open);
+        std::string suffix = word.substr(close + 1);
+        int depth = 0;
+        size_t start = open + 1;
+        for (size_t i = open + 1; i <= close; i++)
+        {
+            if (word[i] == '{')
+            {
+                depth++;
+            }
+            else if (word[i] == '}' && depth > 0)
+            {
+                depth--;
+            }
+            else if ((word[i] == ',' && depth == 0) || i == close)
+            {
+                _expandBraces(prefix + word.substr(start, i - start) + suffix, out);
+                start = i + 1;
+            }
+        }
+        return;
+    }
+    out->push_back(word);
+}
+
+/**
+ * Expands {a,b} alternatives and then *, ? and [...] patterns through
+ * glob(3). A pattern that matches nothing is passed on as is, like bash.
+ * Quoted words are taken literally.
+ * #_expandArguments
+ */
+void _expandArguments(const Token *tokens, int num_tokens, std::vector<std::string> *out)
+{
+    for (int i = 0; i < num_tokens; i++)
+    {
+        if (tokens[i].type != TokenWord)
+        {
+            continue;
+        }
+        std::vector<std::string> words;
+        if (!tokens[i].quoted && std::strchr(tokens[i].text, '{') != nullptr)
+        {
+            _expandBraces(tokens[i].text, &words);
+        }
+        else
+        {
+            words.push_back(tokens[i].text);
+        }
+        if (tokens[i].quoted)
+        {
+            out->push_back(words[0]);
+            continue;
+        }
+
+        for (size_t w = 0; w < words.size(); w++)
+        {
+            if (words[w].find_first_of("*?[") == std::string::npos)
+            {
+                out->push_back(words[w]);
+                continue;
+            }
+            glob_t matches;
+            if (glob(words[w].c_str(), GLOB_NOCHECK, nullptr, &matches) != 0)
+            {
+                out->push_back(words[w]);
+                continue;
+            }
+            for (size_t m = 0; m < matches.gl_pathc; m++)
+            {
+                out->push_back(matches.gl_pathv[m]);
+            }
+            globfree(&matches);
+        }
+    }
+}
+
+// Expands the arguments and launches the program, see spawnProcess for
+// the meaning of the fds
+pid_t ExternalCommand::spawn(int fd_in, int fd_out, int fd_err)
 {
+    SmallShell &smash = SmallShell::getInstance();
+
+    // Wildcards and braces are expanded here, the result goes straight to exec
+    std::vector<std::string> words;
+    _expandArguments(tokens, num_tokens, &words);
+    if (words.empty())
+    {
+        return -1;
+    }
+    std::vector<char *> argv;
+    for (size_t i = 0; i < words.size(); i++)
+    {
+        argv.push_back((char *)words[i].c_str());
+    }
+    argv.push_back(nullptr);
+
+    return smash.spawnProcess(argv[0], argv.data(), fd_in, fd_out, fd_err);
+}
 
+void ExternalCommand::execute()
+{
+    SMASH_PROBE(StatExternal);
     SmallShell &smash = SmallShell::getInstance();
     smash.jobsList->removeFinishedJobs();
+    bool isBackground = _isBackgroundComamnd(cmd_line);
+
+    pid_t pid = spawn();
+    if (pid == -1)
+    {
+        smash.last_status = 127;
+        return;
+    }
+
+    if (isBackground)
+    {
+        smash.jobsList->addJob(this, pid);
+    }
+    else
+    { // foreground
+        smash.UpdateForeground(this, pid);
+        int status;
+        if (_waitChild(pid, &status, WUNTRACED) == pid)
+        {
+            smash.last_status = _exitStatusOf(status);
+        }
+        smash.UpdateForeground(nullptr, -1);
+        smash.jobsList->removeFinishedJobs();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+///                         #RedirectionCommand                        ///
+////////////////////////////////////////////////////////////////////////
+
+// The operator CreateCommand dispatched on: the first one on the line
+static const Token *_firstOperator(const Token *tokens, int num_tokens)
+{
+    for (int i = 0; i < num_tokens; i++)
+    {
+        if (tokens[i].type != TokenWord && tokens[i].type != TokenBackground)
+        {
+            return &tokens[i];
+        }
+    }
+    return nullptr;
+}
+
+void RedirectCommandIntoTwoParts(const char *cmd_line, const Token *tokens, int num_tokens,
+                                 std::string *command, std::string *output_file)
+{
+    const Token *redirection = _firstOperator(tokens, num_tokens);
+    *command = _trim(string(cmd_line, redirection->start));
+    // the file is the word right after the operator, already unquoted
+    const Token *file = redirection + 1;
+    *output_file = (file < tokens + num_tokens && file->type == TokenWord) ? file->text : "";
+
+    // Ignore background sign in the CMD
+    _removeBackgroundSign((char *)(command->c_str()));
+
+    // Trim again for good measure
+    *command = _trim(*command);
+}
+
+void RedirectionCommand::execute()
+{
+    SMASH_PROBE(StatRedirect);
+    SmallShell &smash = SmallShell::getInstance();
+
+    std::string command, output_file;
+
+    // Split command into two usable parts
+    RedirectCommandIntoTwoParts(this->cmd_line, tokens, num_tokens, &command,
+                                &output_file);
+
+    // We now want to use the Open system call to open the requested file
+    // descriptor, Which should open in the lowest available integer
+
+    int requested_file_desc =
+        open(output_file.c_str(),
+             (this->type == Append) ? O_CREAT | O_WRONLY | O_APPEND
+                                    : O_CREAT | O_WRONLY | O_TRUNC,
+             0655);
+
+    if (requested_file_desc == -1)
+    {
+        _perror("smash error: open failed");
+        return;
+    }
+
+    // Anything still buffered was meant for the old std_out
+    smash.flushOutput();
+
+    // We now want to close the normal std_out and duplicate it into the
+    // variable new_std_out
+    int new_std_out = dup(1); // 1 is std_out
+    if (new_std_out == -1)
+    {
+        _perror("smash error: dup failed");
+        return;
+    }
+    int res = close(1); // close original std_out
+    if (res == -1)
+    {
+        _perror("smash error: close failed");
+        return;
+    }
+
+    if (dup2(requested_file_desc, 1) == -1)
+    {
+        _perror("smash error: dup2 failed");
+        return;
+    }
+
+    // We now want to execute the command that is found in the first portion
+    smash.executeCommand(command.c_str());
+    // its output belongs to the file, not to whatever fd 1 is next
+    smash.flushOutput();
+
+    // Close the file we opened
+    if (close(requested_file_desc) == -1)
+    {
+        _perror("smash error: close failed");
+        return;
+    }
+
+    // try
+    if (close(1) == -1)
+    {
+        _perror("smash error: close failed");
+        return;
+    }
+
+    // return stdout to its oriignal place
+    if (dup2(new_std_out, 1) == -1)
+    {
+        _perror("smash error: dup2 failed");
+        return;
+    }
+
+    //  unneccesary copy of std_out
+    if (close(new_std_out) == -1)
+    {
+        _perror("smash error: close failed");
+        return;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+///                         #pipeCommand                             ///
+////////////////////////////////////////////////////////////////////////
+
+// One stage of a pipeline. pipeStderr is set when the stage is followed by
+// |&, its stderr rather than its stdout then feeds the next stage.
+struct PipelineStage
+{
+    std::string command;
+    bool pipeStderr;
+};
+
+void SplitPipeline(const char *cmd_line, const Token *tokens, int num_tokens,
+                   std::vector<PipelineStage> *stages)
+{
+    int stage_start = 0;
+    for (int i = 0; i <= num_tokens; i++)
+    {
+        if (i < num_tokens && tokens[i].type != TokenPipe && tokens[i].type != TokenPipeErr)
+        {
+            continue;
+        }
+        int stage_end = (i < num_tokens) ? tokens[i].start : (int)strlen(cmd_line);
+        PipelineStage stage;
+        stage.command = string(cmd_line + stage_start, stage_end - stage_start);
+        // Ignore background sign, pipelines always run in the foreground
+        _removeBackgroundSign((char *)(stage.command.c_str()));
+        stage.command = _trim(string(stage.command.c_str()));
+        stage.pipeStderr = (i < num_tokens && tokens[i].type == TokenPipeErr);
+        stages->push_back(stage);
+        if (i < num_tokens)
+        {
+            stage_start = tokens[i].end;
+        }
+    }
+}
+
+// Closes every pipe end that is still open (-1 marks one closed already)
+static void _closePipes(const std::vector<int> &pipe_fds)
+{
+    for (size_t i = 0; i < pipe_fds.size(); i++)
+    {
+        if (pipe_fds[i] != -1 && close(pipe_fds[i]) == -1)
+        {
+            _perror("smash error: close failed");
+        }
+    }
+}
+
+// Runs a pure builtin stage inside the shell with its output going to fd
+// (into the target descriptor, 1 or 2), the same fd swap RedirectionCommand
+// does. The caller must hold no read end of that pipe: then a reader that
+// quits makes the write fail with EPIPE. A reader that is alive but never
+// reads still blocks it.
+static void _runStageInProcess(Command *stage, int fd, int target)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.flushOutput();
+    fflush(stdout);
+    int saved = dup(target);
+    if (saved == -1)
+    {
+        _perror("smash error: dup failed");
+        return;
+    }
+    if (dup2(fd, target) == -1)
+    {
+        _perror("smash error: dup2 failed");
+        close(saved);
+        return;
+    }
+
+    stage->execute();
+
+    // a reader that quit early leaves cout failed with EPIPE, drop that
+    smash.flushOutput();
+    fflush(stdout);
+    std::cout.clear();
+    clearerr(stdout);
+    if (dup2(saved, target) == -1)
+    {
+        _perror("smash error: dup2 failed");
+    }
+    close(saved);
+}
+
+/**
+ * Runs a1 | a2 | ... | aN: all N-1 pipes are created up front and every
+ * stage is started directly from the shell. External stages are spawned
+ * with the pipe ends as their stdio. Pure builtins (jobs, pwd, listdir...)
+ * run inside the shell once every other stage is running; other builtins
+ * get a forked child.
+ * #PipeCommand
+ */
+void PipeCommand::execute()
+{
+    SMASH_PROBE(StatPipe);
+    int pipe_read = 0;
+    int pipe_write = 1;
+    int STD_IN_INDEX = 0;
+    int STD_OUT_INDEX = 1;
+    int STD_ERR_INDEX = 2;
+
+    SmallShell &smash = SmallShell::getInstance();
+
+    std::vector<PipelineStage> stages;
+    SplitPipeline(this->cmd_line, tokens, num_tokens, &stages);
+    size_t num_stages = stages.size();
+
+    // Create every pipe first. They are close-on-exec so each spawned stage
+    // only keeps the two ends it was given.
+    std::vector<int> pipe_fds;
+    for (size_t i = 0; i + 1 < num_stages; i++)
+    {
+        int pipe_file_desc[2];
+        if (pipe2(pipe_file_desc, O_CLOEXEC) == -1)
+        {
+            _perror("smash error: pipe failed");
+            _closePipes(pipe_fds);
+            return;
+        }
+        if (smash.pipe_capacity > 0 &&
+            fcntl(pipe_file_desc[pipe_write], F_SETPIPE_SZ, smash.pipe_capacity) == -1)
+        {
+            _perror("smash error: fcntl failed");
+        }
+        pipe_fds.push_back(pipe_file_desc[pipe_read]);
+        pipe_fds.push_back(pipe_file_desc[pipe_write]);
+    }
 
-    if (num_args == 1)
+    std::vector<pid_t> stage_pids;
+    pid_t last_stage_pid = -1;
+    std::vector<Command *> in_process(num_stages, nullptr);
+    std::vector<int> stage_outputs(num_stages, -1);
+    std::vector<int> stage_targets(num_stages, STD_OUT_INDEX);
+    for (size_t i = 0; i < num_stages; i++)
     {
-        int job_ID;
+        // stdin from the previous pipe, stdout or stderr into the next one
+        int stage_fds[3] = {-1, -1, -1};
+        if (i > 0)
+        {
+            stage_fds[STD_IN_INDEX] = pipe_fds[2 * (i - 1) + pipe_read];
+        }
+        if (i + 1 < num_stages)
+        {
+            stage_targets[i] = stages[i].pipeStderr ? STD_ERR_INDEX : STD_OUT_INDEX;
+            stage_fds[stage_targets[i]] = pipe_fds[2 * i + pipe_write];
+            stage_outputs[i] = pipe_fds[2 * i + pipe_write];
+        }
 
-        if (smash.jobsList->getLastJob(&job_ID) == nullptr)
+        Command *stage = smash.prepareCommand(stages[i].command.c_str());
+        if (stage == nullptr)
         {
-            std::cerr << "smash error: fg: jobs list is empty"
-                      << endl;
-            return;
+            continue;
         }
 
-        JobEntry *my_job = smash.jobsList->getLastJob(&job_ID);
+        ExternalCommand *external = dynamic_cast<ExternalCommand *>(stage);
+        if (external != nullptr)
+        {
+            pid_t pid = external->spawn(stage_fds[STD_IN_INDEX], stage_fds[STD_OUT_INDEX], stage_fds[STD_ERR_INDEX]);
+            if (pid != -1)
+            {
+                stage_pids.push_back(pid);
+                last_stage_pid = (i + 1 == num_stages) ? pid : last_stage_pid;
+            }
+            delete stage;
+            continue;
+        }
 
-        // Cont. job in case it has been stopped
-        if (my_job->isStopped)
+        if (dynamic_cast<RedirectionCommand *>(stage) == nullptr &&
+            BuiltinRegistry::getInstance().isPure(stage->args[0]))
         {
-            if (kill(my_job->PID, SIGCONT) == -1)
+            // run after every forked stage is up, see below
+            in_process[i] = stage;
+            continue;
+        }
+
+        smash.flushOutput();
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            _perror("smash error: fork failed");
+            delete stage;
+            continue;
+        }
+        if (pid == 0)
+        {
+            if (setpgrp())
             {
-                perror("smash error: kill failed");
-                return;
+                _perror("smash error: setpgrp failed");
+                exit(EXIT_FAILURE);
+            }
+            smash.leaveEventLoop();
+            for (int fd = 0; fd < 3; fd++)
+            {
+                if (stage_fds[fd] != -1 && dup2(stage_fds[fd], fd) == -1)
+                {
+                    _perror("smash error: dup2 failed");
+                    exit(EXIT_FAILURE);
+                }
             }
-            my_job->isStopped = false;
+            // Close unneccesary channels
+            _closePipes(pipe_fds);
+
+            // Then execute the stage, builtins and redirections run here
+            stage->execute();
+            smash.flushOutput();
+            exit(EXIT_SUCCESS);
         }
-        cout << my_job->command << " " << my_job->PID << endl;
+        stage_pids.push_back(pid);
+        last_stage_pid = (i + 1 == num_stages) ? pid : last_stage_pid;
+        delete stage;
+    }
 
-        smash.UpdateForeground(my_job->cmnd, my_job->PID);
-        int temp_pid = my_job->PID;
+    // Every other stage has its ends by now. The shell keeps only the write
+    // ends of the in-process stages: a builtin never reads its stdin, and a
+    // read end left open here would keep a writer whose reader quit from
+    // ever getting EPIPE, ours included.
+    for (size_t i = 0; i < pipe_fds.size(); i++)
+    {
+        bool keep = (i % 2 == (size_t)pipe_write) && in_process[i / 2] != nullptr;
+        if (!keep && pipe_fds[i] != -1)
+        {
+            close(pipe_fds[i]);
+            pipe_fds[i] = -1;
+        }
+    }
+
+    // Every forked stage inherited the default SIGPIPE already, the shell
+    // itself must survive a reader that quits early
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    for (size_t i = 0; i < num_stages; i++)
+    {
+        if (in_process[i] == nullptr)
+        {
+            continue;
+        }
+        SMASH_PROBE_INTO(in_process[i]->stats);
+        if (stage_outputs[i] != -1)
+        {
+            _runStageInProcess(in_process[i], stage_outputs[i], stage_targets[i]);
+            // done writing, the next stage sees EOF once we close below
+            close(stage_outputs[i]);
+            pipe_fds[2 * i + pipe_write] = -1;
+        }
+        else
+        {
+            in_process[i]->execute();
+        }
+        delete in_process[i];
+    }
+    signal(SIGPIPE, old_sigpipe);
 
-        waitpid(temp_pid, nullptr, WUNTRACED);
+    // Now for the parent proccess, we want to close every channel
+    _closePipes(pipe_fds);
 
-        smash.UpdateForeground(nullptr, -1);
-        smash.jobsList->removeFinishedJobs();
-        return;
+    // the pipeline's status is the one of its last stage
+    for (size_t i = 0; i < stage_pids.size(); i++)
+    {
+        int status;
+        if (_waitChild(stage_pids[i], &status, WUNTRACED) == -1)
+        {
+            _perror("smash error: waitpid failed");
+        }
+        else if (stage_pids[i] == last_stage_pid)
+        {
+            smash.last_status = _exitStatusOf(status);
+        }
     }
+}
 
-    int jobID;
+////////////////////////////////////////////////////////////////////////
+///                              #SetCore                             ///
+////////////////////////////////////////////////////////////////////////
 
-    try
+// Simple Auxiliary function that checks if a given char* is a number
+bool TextIsNumber(const char *text)
+{
+    int pos = 0;
+    char NULL_TERM = '\0';
+    while (text[pos] != NULL_TERM)
     {
-        jobID = stoi((args[1]));
+        if (!isdigit(text[pos]))
+        {
+            return false;
+        }
+        pos++;
     }
-    catch (...)
+    return true;
+}
+
+// taskset style: 0-3,8,10-11. out_of_range is set when a cpu in it is
+// past the ones the machine has.
+static bool _parseCpuList(const char *text, cpu_set_t *set, bool *out_of_range)
+{
+    static const long configured_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    CPU_ZERO(set);
+    *out_of_range = false;
+    const char *cursor = text;
+    while (true)
+    {
+        char *end;
+        if (!isdigit(*cursor))
+        {
+            return false;
+        }
+        long first = strtol(cursor, &end, 10);
+        long last = first;
+        if (*end == '-')
+        {
+            if (!isdigit(end[1]))
+            {
+                return false;
+            }
+            last = strtol(end + 1, &end, 10);
+            if (last < first)
+            {
+                return false;
+            }
+        }
+        if (last >= configured_cpus || last >= CPU_SETSIZE)
+        {
+            *out_of_range = true;
+            return true;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, set);
+        }
+        if (*end == '\0')
+        {
+            return true;
+        }
+        if (*end != ',')
+        {
+            return false;
+        }
+        cursor = end + 1;
+    }
+}
+
+// The other way around, 0,1,2,3,8 -> 0-3,8
+static std::string _formatCpuList(const cpu_set_t &set)
+{
+    std::string list;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &set))
+        {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set))
+        {
+            last++;
+        }
+        list += (list.empty() ? "" : ",") + std::to_string(cpu);
+        if (last > cpu)
+        {
+            list += "-" + std::to_string(last);
+        }
+        cpu = last;
+    }
+    return list;
+}
+
+// The numeric entries of a /proc directory: pids, or the tids of a task dir
+static void _listProcIds(const char *path, std::vector<pid_t> *ids)
+{
+    DIR *dir = opendir(path);
+    if (dir == nullptr)
     {
-        std::cerr << "smash error: fg: invalid arguments" << endl;
         return;
     }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        if (isdigit(entry->d_name[0]) && TextIsNumber(entry->d_name))
+        {
+            ids->push_back(atoi(entry->d_name));
+        }
+    }
+    closedir(dir);
+}
 
-    JobEntry *my_job = smash.jobsList->getJobById(jobID);
+// Every process whose process group is pgid, a job's pipeline and children
+static void _listProcessGroup(pid_t pgid, std::vector<pid_t> *pids)
+{
+    std::vector<pid_t> all;
+    _listProcIds("/proc", &all);
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/stat", all[i]);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            continue;
+        }
+        char buffer[512];
+        ssize_t got = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+        if (got <= 0)
+        {
+            continue;
+        }
+        buffer[got] = '\0';
+        // pid (comm) state ppid pgrp, comm may hold spaces and parens
+        const char *fields = strrchr(buffer, ')');
+        int group;
+        if (fields != nullptr && sscanf(fields + 2, "%*c %*d %d", &group) == 1 && group == pgid)
+        {
+            pids->push_back(all[i]);
+        }
+    }
+}
 
-    if (my_job == nullptr)
+static void _listThreads(pid_t pid, std::vector<pid_t> *tids)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    _listProcIds(path, tids);
+}
+
+/**
+ * setcore [-g] job-id [cpulist]
+ * Pins every thread of the job to the cpus of cpulist (taskset syntax,
+ * 0-3,8,10-11). With -g every process in the job's process group is
+ * pinned as well. Without a cpulist it prints the affinity of each thread.
+ * #SetcoreCommand
+ */
+void SetcoreCommand::execute()
+{
+    SmallShell &smash = SmallShell::getInstance();
+    int arg = 1;
+    bool whole_group = (arg < num_args && strcmp(args[arg], "-g") == 0);
+    arg += whole_group ? 1 : 0;
+    char *job_id = (arg < num_args) ? args[arg] : nullptr;
+    char *cpu_list = (arg + 1 < num_args) ? args[arg + 1] : nullptr;
+
+    if (job_id == nullptr || job_id[0] == '\0' || !TextIsNumber(job_id) || arg + 2 < num_args)
     {
-        cerr << "smash error: fg: job-id " << jobID << " does not exist"
-             << endl;
+        std::cerr << "smash error: setcore: invalid arguments" << endl;
         return;
     }
-
-    if (num_args >= 3)
+    JobEntry *requested_job = smash.jobsList->getJobById(atoi(job_id));
+    if (requested_job == nullptr)
     {
-        std::cerr << "smash error: fg: invalid arguments" << endl;
+        std::cerr << "smash error: setcore: job-id " << job_id << " does not exist" << std::endl;
         return;
     }
 
-    // Cont. job in case it has been stopped
-    if (my_job->isStopped)
+    cpu_set_t cpus;
+    if (cpu_list != nullptr)
     {
-        if (kill(my_job->PID, SIGCONT) == -1)
+        bool out_of_range;
+        if (!_parseCpuList(cpu_list, &cpus, &out_of_range))
         {
-            perror("smash error: kill failed");
+            std::cerr << "smash error: setcore: invalid arguments" << endl;
+            return;
+        }
+        if (out_of_range)
+        {
+            std::cerr << "smash error: setcore: invalid core number" << std::endl;
             return;
         }
-        my_job->isStopped = false;
     }
 
-    cout << my_job->command << " " << my_job->PID << endl;
+    std::vector<pid_t> pids;
+    if (whole_group)
+    {
+        _listProcessGroup(requested_job->PID, &pids);
+    }
+    if (std::find(pids.begin(), pids.end(), requested_job->PID) == pids.end())
+    {
+        pids.insert(pids.begin(), requested_job->PID);
+    }
 
-    smash.UpdateForeground(my_job->cmnd, my_job->PID);
-    int temp_pid = my_job->PID;
+    if (cpu_list == nullptr)
+    {
+        for (size_t p = 0; p < pids.size(); p++)
+        {
+            std::vector<pid_t> tids;
+            _listThreads(pids[p], &tids);
+            std::sort(tids.begin(), tids.end());
+            for (size_t t = 0; t < tids.size(); t++)
+            {
+                cpu_set_t current;
+                if (sched_getaffinity(tids[t], sizeof(current), &current) == -1)
+                {
+                    continue; // the thread is gone
+                }
+                std::cout << "pid " << pids[p] << " tid " << tids[t] << ": " << _formatCpuList(current) << std::endl;
+            }
+        }
+        return;
+    }
 
-    waitpid(temp_pid, nullptr, WUNTRACED);
-    smash.UpdateForeground(nullptr, -1);
-    smash.jobsList->removeFinishedJobs();
+    // a thread may start while we go through the list, so go again until
+    // a pass finds none we haven't pinned
+    std::set<pid_t> pinned;
+    for (int pass = 0; pass < 8; pass++)
+    {
+        bool found_new = false;
+        for (size_t p = 0; p < pids.size(); p++)
+        {
+            std::vector<pid_t> tids;
+            _listThreads(pids[p], &tids);
+            if (tids.empty() && pids[p] == requested_job->PID)
+            {
+                std::cerr << "smash error: setcore: job-id " << job_id << " does not exist" << std::endl;
+                return;
+            }
+            for (size_t t = 0; t < tids.size(); t++)
+            {
+                if (!pinned.insert(tids[t]).second)
+                {
+                    continue;
+                }
+                found_new = true;
+                if (sched_setaffinity(tids[t], sizeof(cpus), &cpus) == -1)
+                {
+                    if (errno == ESRCH)
+                    {
+                        continue; // exited in between
+                    }
+                    if (errno == EINVAL)
+                    {
+                        std::cerr << "smash error: setcore: invalid core number" << std::endl;
+                        return;
+                    }
+                    _perror("smash error: sched_setaffinity failed");
+                    return;
+                }
+            }
+        }
+        if (!found_new)
+        {
+            break;
+        }
+    }
 }
-
-void TimeoutCommand::execute() {}
-
-bool TextIsNumber(const char *text);
+REGISTER_BUILTIN("setcore", SetcoreCommand);
 
 ////////////////////////////////////////////////////////////////////////
-///                           KillCommand                            ///
+///                            #GetFileTypeCommand                   ///
 ////////////////////////////////////////////////////////////////////////
 
-void KillCommand::execute()
-{ /// remember to ask if checking the validity of
-  /// jobID is always necessary!! (not only here
-  /// but everywhere)
-
-    SmallShell &smash = SmallShell::getInstance();
-    smash.jobsList->removeFinishedJobs();
+void GetFileTypeCommand::execute()
+{
+    struct stat file_info;
+    char *file_path = args[1];
 
-    std::string jobNumStr;
-    int jobID;
-    try
-    {
-        jobNumStr = std::string(args[2]);
-        jobID = stoi(jobNumStr);
-    }
-    catch (...)
+    if (this->args[2] != nullptr)
     {
-        std::cerr << "smash error: kill: invalid arguments" << endl;
+        cerr << "smash error: gettype: invalid arguments" << endl;
         return;
     }
 
-    if (!TextIsNumber(jobNumStr.c_str()))
+    if (this->args[1] == nullptr)
     {
-        std::cerr << "smash error: kill: invalid arguments" << endl;
+        cerr << "smash error: gettype: invalid arguments" << endl;
         return;
     }
 
-    JobEntry *my_job = smash.jobsList->getJobById(jobID);
-    if (my_job == nullptr)
+    if (stat(file_path, &file_info) == -1)
     {
-        cerr << "smash error: kill: job-id " << jobID << " does not exist"
-             << endl;
+
+        _perror("smash error: stat failed");
         return;
     }
 
-    std::string numStr = std::string(args[1]).substr(1);
+    std::cout << file_path << "'s type is \"";
 
-    int sigNum;
-    try
+    if (S_ISREG(file_info.st_mode))
     {
-        sigNum = stoi(numStr);
+        std::cout << "regular file";
     }
-    catch (...)
+    else if (S_ISDIR(file_info.st_mode))
     {
-        std::cerr << "smash error: kill: invalid arguments" << endl;
-        return;
+        std::cout << "directory";
     }
-
-    if (num_args !=
-        3)
-    { // make sure that this is enough, rather than checking if #<3
-        std::cerr << "smash error: kill: invalid arguments" << endl;
-        return;
+    else if (S_ISCHR(file_info.st_mode))
+    {
+        std::cout << "character device";
     }
-
-    char *sig_num_string = new char[strlen(args[1]) + 1];
-    strcpy(sig_num_string, args[1]);
-    if (sig_num_string[0] != '-')
+    else if (S_ISBLK(file_info.st_mode))
     {
-        std::cerr << "smash error: kill: invalid arguments" << endl;
-        return;
+        std::cout << "block device";
+    }
+    else if (S_ISFIFO(file_info.st_mode))
+    {
+        std::cout << "FIFO";
+    }
+    else if (S_ISLNK(file_info.st_mode))
+    {
+        std::cout << "symbolic link";
     }
-
-    sig_num_string = sig_num_string + 1;
-    if (!TextIsNumber(sig_num_string))
+    else if (S_ISSOCK(file_info.st_mode))
     {
-        std::cerr << "smash error: kill: invalid arguments" << endl;
-        return;
+        std::cout << "socket";
     }
 
-    pid_t pid = my_job->PID;
-    switch (sigNum)
+    std::cout << "\" and takes up " << file_info.st_size << " bytes" << endl;
+}
+REGISTER_PURE_BUILTIN("getfiletype", GetFileTypeCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                            #ChmodCommand                        ///
+////////////////////////////////////////////////////////////////////////
+void ChmodCommand::execute()
+{
+    // SmallShell& smash = SmallShell::getInstance();
+    if (args[3] != nullptr)
     {
-    case SIGSTOP:
-        my_job->isStopped = true;
-        break;
-    case SIGCONT:
-        my_job->isStopped = false;
-        break;
+        cerr << "smash error: chmod: invalid arguments" << endl;
+        return;
     }
-    if (kill(my_job->PID, sigNum) == -1)
+    if (!TextIsNumber(args[1]))
     {
-        perror("smash error: kill failed");
+        cerr << "smash error: chmod: invalid arguments" << endl;
         return;
     }
-    smash.jobsList->removeFinishedJobs();
-    if (sigNum == SIGKILL)
+
+    int mode = std::stoi(args[1], nullptr, 8);
+
+    char *file_path = args[2];
+
+    if (chmod(file_path, mode) == -1)
     {
-        smash.jobsList->removeJobById(my_job->jobID);
+        _perror("smash error: chmod failed");
+        return;
     }
-    std::cout << "signal number " << sigNum << " was sent to pid " << pid << std::endl;
 }
+REGISTER_BUILTIN("chmod", ChmodCommand);
 
 ////////////////////////////////////////////////////////////////////////
-///                         #External Commands                       ///
+///                             #CopyCommand                         ///
 ////////////////////////////////////////////////////////////////////////
 
-void SmallShell::UpdateForeground(Command *command, pid_t pid)
-{
-    SmallShell &smash = SmallShell::getInstance();
-    smash.foreground_command = command;
-    smash.foreground_pid = pid;
-}
-
-void ExternalCommand::execute()
+// Copies everything left in in_fd to out_fd at the current offsets. Tries
+// the cheapest kernel path first and falls back once it is not supported
+// for this pair of files: a reflink shares the extents and copies nothing,
+// copy_file_range and sendfile copy inside the kernel, read/write is last.
+static bool _copyFileData(int in_fd, int out_fd, off_t size)
 {
-    SmallShell &smash = SmallShell::getInstance();
-    smash.jobsList->removeFinishedJobs();
-    bool isBackground = _isBackgroundComamnd(cmd_line);
-    char *cmd_line_local = new char[strlen(cmd_line) + 1];
-    strcpy(cmd_line_local, this->cmd_line);
-    _removeBackgroundSign(cmd_line_local);
-    char **args = new char *[20];
-    int arg_count = _parseCommandLine(cmd_line_local, args);
-    bool isComplex = false;
-    // Check type
-
-    for (int i = 0; i < arg_count; i++)
+    if (ioctl(out_fd, FICLONE, in_fd) == 0)
     {
-        if (std::strchr(args[i], '*') != nullptr ||
-            std::strchr(args[i], '?') != nullptr)
-        {
-            isComplex = true;
-        }
+        return true;
     }
 
-    pid_t pid = fork();
-    if (pid == -1)
+    bool use_copy_range = true;
+    bool use_sendfile = true;
+    off_t copied = 0;
+    while (copied < size)
     {
-        perror("smash error: fork failed");
-        return;
-    }
-    if (pid == 0)
-    { // Child Process
-        setpgrp();
-        if (isComplex)
+        size_t chunk = (size - copied) > (1 << 30) ? (1 << 30) : (size_t)(size - copied);
+        ssize_t n = -1;
+        if (use_copy_range)
         {
-            if (execl("/bin/bash", "/bin/bash", "-c", cmd_line, NULL) == -1)
+            n = copy_file_range(in_fd, nullptr, out_fd, nullptr, chunk, 0);
+            if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                            errno == EOPNOTSUPP || errno == EBADF))
             {
-                perror("smash error: execl failed"); // TODO execl or exec
-                exit(EXIT_FAILURE);
+                use_copy_range = false;
+                continue;
+            }
+        }
+        else if (use_sendfile)
+        {
+            n = sendfile(out_fd, in_fd, nullptr, chunk);
+            if (n == -1 && (errno == ENOSYS || errno == EINVAL))
+            {
+                use_sendfile = false;
+                continue;
             }
         }
         else
-        { // Simple
-            if (execvp(args[0], args) == -1)
+        {
+            char buffer[64 * 1024];
+            n = read(in_fd, buffer, sizeof(buffer));
+            for (ssize_t written = 0; n > 0 && written < n;)
             {
-                perror("smash error: execvp failed"); // TODO same
-                exit(EXIT_FAILURE);
+                ssize_t w = write(out_fd, buffer + written, n - written);
+                if (w == -1 && errno != EINTR)
+                {
+                    return false;
+                }
+                written += (w == -1) ? 0 : w;
             }
         }
-        exit(EXIT_SUCCESS);
-    }
-    else
-    { // Parent process
 
-        if (isBackground)
+        if (n == -1)
         {
-
-            smash.jobsList->addJob(this, pid);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
         }
-        else
-        { // foreground
-            smash.UpdateForeground(this, pid);
-            waitpid(pid, nullptr, WUNTRACED);
-            smash.UpdateForeground(nullptr, -1);
-            smash.jobsList->removeFinishedJobs();
+        if (n == 0)
+        {
+            // the file shrank under us, what we have is the copy
+            break;
         }
+        copied += n;
     }
+    return true;
 }
 
-////////////////////////////////////////////////////////////////////////
-///                         #RedirectionCommand                        ///
-////////////////////////////////////////////////////////////////////////
-
-void RedirectCommandIntoTwoParts(std::string *string_cmd_line,
-                                 RedirectType type, std::string *command,
-                                 std::string *output_file)
+// Copies source to destination, keeping the source's mode bits. On failure
+// error holds the smash error line to print.
+static bool _copyFile(const std::string &source, const std::string &destination, std::string *error)
 {
-    if (type == Append)
-    { // >>
-
-        size_t redirection_position = string_cmd_line->find(">>");
-        *command = _trim(string_cmd_line->substr(0, redirection_position));
-        *output_file = _trim(string_cmd_line->substr(redirection_position + 2));
+    int in_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in_fd == -1)
+    {
+        *error = "smash error: cp: " + source + ": " + strerror(errno);
+        return false;
+    }
+    struct stat source_info;
+    if (fstat(in_fd, &source_info) == -1)
+    {
+        *error = "smash error: cp: " + source + ": " + strerror(errno);
+        close(in_fd);
+        return false;
+    }
+    if (S_ISDIR(source_info.st_mode))
+    {
+        *error = "smash error: cp: " + source + ": is a directory";
+        close(in_fd);
+        return false;
     }
-    else if (type == Override)
-    { // >
 
-        size_t redirection_position = string_cmd_line->find(">");
-        *command = _trim(string_cmd_line->substr(0, redirection_position));
-        *output_file = _trim(string_cmd_line->substr(redirection_position + 1));
+    struct stat destination_info;
+    if (stat(destination.c_str(), &destination_info) == 0 &&
+        destination_info.st_dev == source_info.st_dev && destination_info.st_ino == source_info.st_ino)
+    {
+        *error = "smash error: cp: " + source + " and " + destination + " are the same file";
+        close(in_fd);
+        return false;
     }
 
-    // Ignore background sign in both CMD and File
-    _removeBackgroundSign((char *)(command->c_str()));
-    _removeBackgroundSign((char *)(output_file->c_str()));
+    int out_fd = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, source_info.st_mode & 07777);
+    if (out_fd == -1)
+    {
+        *error = "smash error: cp: " + destination + ": " + strerror(errno);
+        close(in_fd);
+        return false;
+    }
 
-    // Trim again for good measure
-    *command = _trim(*command);
-    *output_file = _trim(*output_file);
+    bool ok = _copyFileData(in_fd, out_fd, source_info.st_size);
+    if (!ok)
+    {
+        *error = "smash error: cp: " + destination + ": " + strerror(errno);
+    }
+    // open() applied the umask and leaves an existing file's mode alone
+    else if (fchmod(out_fd, source_info.st_mode & 07777) == -1)
+    {
+        *error = "smash error: cp: " + destination + ": " + strerror(errno);
+        ok = false;
+    }
+    close(in_fd);
+    if (close(out_fd) == -1 && ok)
+    {
+        *error = "smash error: cp: " + destination + ": " + strerror(errno);
+        ok = false;
+    }
+    return ok;
 }
 
-void RedirectionCommand::execute()
+/**
+ * cp source destination
+ * cp source... directory
+ * Several sources are copied in parallel by a small pool of threads, their
+ * errors are printed afterwards in the order the sources were given.
+ * Options, and lines that are no copy at all, go to the system cp.
+ * #CopyCommand
+ */
+void CopyCommand::execute()
 {
-    SmallShell &smash = SmallShell::getInstance();
+    bool plain = num_args >= 3;
+    for (int i = 1; i < num_args && plain; i++)
+    {
+        plain = args[i][0] != '-';
+    }
+    if (!plain)
+    {
+        Command *external = new ExternalCommand(cmd_line, TokenList(tokens, num_tokens));
+        external->execute();
+        if (!external->ownedByJob)
+        {
+            delete external;
+        }
+        return;
+    }
 
-    std::string string_cmd_line(this->cmd_line);
-    std::string command, output_file;
+    std::string target = args[num_args - 1];
+    struct stat target_info;
+    bool target_is_dir = stat(target.c_str(), &target_info) == 0 && S_ISDIR(target_info.st_mode);
+    if (num_args > 3 && !target_is_dir)
+    {
+        cerr << "smash error: cp: " << target << ": not a directory" << endl;
+        return;
+    }
 
-    // Split command into two usable parts
-    RedirectCommandIntoTwoParts(&string_cmd_line, this->type, &command,
-                                &output_file);
+    std::vector<std::string> sources;
+    std::vector<std::string> destinations;
+    for (int i = 1; i < num_args - 1; i++)
+    {
+        sources.push_back(args[i]);
+        if (target_is_dir)
+        {
+            std::string source = args[i];
+            size_t slash = source.find_last_of('/');
+            std::string base = (slash == std::string::npos) ? source : source.substr(slash + 1);
+            destinations.push_back(target + "/" + base);
+        }
+        else
+        {
+            destinations.push_back(target);
+        }
+    }
 
-    // We now want to use the Open system call to open the requested file
-    // descriptor, Which should open in the lowest available integer
+    std::vector<std::string> errors(sources.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]()
+    {
+        for (size_t i = next++; i < sources.size(); i = next++)
+        {
+            _copyFile(sources[i], destinations[i], &errors[i]);
+        }
+    };
 
-    int requested_file_desc =
-        open(output_file.c_str(),
-             (this->type == Append) ? O_CREAT | O_WRONLY | O_APPEND
-                                    : O_CREAT | O_WRONLY | O_TRUNC,
-             0655);
+    unsigned workers = std::thread::hardware_concurrency();
+    workers = (workers == 0 || workers > MAX_WORKERS) ? MAX_WORKERS : workers;
+    workers = (workers > sources.size()) ? sources.size() : workers;
 
-    if (requested_file_desc == -1)
+    // The shell thread is a worker as well, a single copy starts no threads
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < workers; i++)
     {
-        perror("smash error: open failed");
-        return;
+        pool.push_back(std::thread(worker));
     }
-
-    // We now want to close the normal std_out and duplicate it into the
-    // variable new_std_out
-    int new_std_out = dup(1); // 1 is std_out
-    if (new_std_out == -1)
+    worker();
+    for (size_t i = 0; i < pool.size(); i++)
     {
-        perror("smash error: dup failed");
-        return;
+        pool[i].join();
     }
-    int res = close(1); // close original std_out
-    if (res == -1)
+
+    for (size_t i = 0; i < errors.size(); i++)
     {
-        perror("smash error: close failed");
-        return;
+        if (!errors[i].empty())
+        {
+            cerr << errors[i] << endl;
+        }
     }
+}
+REGISTER_BUILTIN("cp", CopyCommand);
 
-    if (dup2(requested_file_desc, 1) == -1)
+////////////////////////////////////////////////////////////////////////
+///                            #SourceCommand                        ///
+////////////////////////////////////////////////////////////////////////
+
+int SourceCommand::depth = 0;
+
+/**
+ * source file: runs every line of file in this shell, as if typed at the
+ * prompt, so aliases, jobs and cd all stick.
+ * #SourceCommand
+ */
+void SourceCommand::execute()
+{
+    if (num_args != 2)
     {
-        perror("smash error: dup2 failed");
+        cerr << "smash error: source: invalid arguments" << endl;
         return;
     }
-
-    // We now want to execute the command that is found in the first portion
-    smash.executeCommand(command.c_str());
-
-    // Close the file we opened
-    if (close(requested_file_desc) == -1)
+    if (depth >= MAX_DEPTH)
     {
-        perror("smash error: close failed");
+        cerr << "smash error: source: too many nested calls" << endl;
         return;
     }
 
-    // try
-    if (close(1) == -1)
+    int fd = open(args[1], O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
     {
-        perror("smash error: close failed");
+        _perror("smash error: open failed");
         return;
     }
 
-    // return stdout to its oriignal place
-    if (dup2(new_std_out, 1) == -1)
+    SmallShell &smash = SmallShell::getInstance();
+    LineReader reader(fd);
+    std::string line;
+    depth++;
+    while (reader.readLine(&line))
     {
-        perror("smash error: dup2 failed");
-        return;
+        smash.executeCommand(line.c_str());
     }
+    depth--;
 
-    //  unneccesary copy of std_out
-    if (close(new_std_out) == -1)
+    if (close(fd) == -1)
     {
-        perror("smash error: close failed");
-        return;
+        _perror("smash error: close failed");
     }
 }
+REGISTER_BUILTIN("source", SourceCommand);
 
 ////////////////////////////////////////////////////////////////////////
-///                         #pipeCommand                             ///
+///                            #JobTopCommand                        ///
 ////////////////////////////////////////////////////////////////////////
 
-void PipeCommandIntoTwoParts(std::string *string_cmd_line, PipeType type,
-                             std::string *command, std::string *output_file)
+// The /proc files of one job, open for as long as jobtop watches it, and
+// its counters at the previous tick
+struct JobSample
 {
-    if (type == Fromstderr)
-    { // |&
+    int statFd;
+    int statmFd;
+    int ioFd;
+    unsigned long long cpuTicks;
+    unsigned long long readBytes;
+    unsigned long long writeBytes;
+    long long sampledAtMs;
+    bool sampled;
+};
 
-        size_t pipe_position = string_cmd_line->find("|&");
-        *command = _trim(string_cmd_line->substr(0, pipe_position));
-        *output_file = _trim(string_cmd_line->substr(pipe_position + 2));
-    }
-    else if (type == Fromstdout)
-    { // |
+// /proc/<pid>/<file>, -1 when it can't be opened. Out of fds it gives -1
+// as well and the file is opened for each sample instead.
+static int _openProcFile(pid_t pid, const char *file)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, file);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
 
-        size_t pipe_position = string_cmd_line->find("|");
-        *command = _trim(string_cmd_line->substr(0, pipe_position));
-        *output_file = _trim(string_cmd_line->substr(pipe_position + 1));
+// One pread from the start of the file, the result is NUL terminated
+static bool _readProcFile(int fd, pid_t pid, const char *file, char *buffer, size_t size)
+{
+    bool opened = false;
+    if (fd == -1)
+    {
+        fd = _openProcFile(pid, file);
+        opened = true;
     }
+    if (fd == -1)
+    {
+        return false;
+    }
+    ssize_t got = pread(fd, buffer, size - 1, 0);
+    if (opened)
+    {
+        close(fd);
+    }
+    if (got <= 0)
+    {
+        return false;
+    }
+    buffer[got] = '\0';
+    return true;
+}
 
-    // Ignore background sign in both CMD and File
-    _removeBackgroundSign((char *)(command->c_str()));
-    _removeBackgroundSign((char *)(output_file->c_str()));
-
-    // Trim again for good measure
-    *command = _trim(*command);
-    *output_file = _trim(*output_file);
+static void _closeJobSample(JobSample *sample)
+{
+    int fds[3] = {sample->statFd, sample->statmFd, sample->ioFd};
+    for (int i = 0; i < 3; i++)
+    {
+        if (fds[i] != -1)
+        {
+            close(fds[i]);
+        }
+    }
 }
 
-void PipeCommand::execute()
+static std::string _formatElapsed(long seconds)
 {
-    int pipe_read = 0;
-    int pipe_write = 1;
-    int STD_OUT_INDEX = 1;
-    int STD_ERR_INDEX = 2;
-    int pipe_file_desc[2];
+    char text[32];
+    snprintf(text, sizeof(text), "%02ld:%02ld:%02ld", seconds / 3600, (seconds / 60) % 60, seconds % 60);
+    return text;
+}
 
+/**
+ * jobtop [interval] [-n count]
+ * A table of every job's state, CPU use, resident memory and I/O rates,
+ * redrawn every interval seconds (default 1) until ctrl-C, count ticks or
+ * the job list running empty. The /proc files of a job stay open between
+ * ticks, a tick costs three preads per job.
+ * #JobTopCommand
+ */
+void JobTopCommand::execute()
+{
     SmallShell &smash = SmallShell::getInstance();
+    double interval = 1;
+    long ticks = -1;
+    for (int i = 1; i < num_args; i++)
+    {
+        char *end;
+        if (strcmp(args[i], "-n") == 0 && i + 1 < num_args && TextIsNumber(args[i + 1]))
+        {
+            ticks = atol(args[++i]);
+        }
+        else if ((interval = strtod(args[i], &end)) <= 0 || *end != '\0')
+        {
+            cerr << "smash error: jobtop: invalid arguments" << endl;
+            return;
+        }
+    }
 
-    std::string string_cmd_line(this->cmd_line);
-    std::string command1, command2;
+    static const long clock_ticks = sysconf(_SC_CLK_TCK);
+    static const long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    bool tty = isatty(STDOUT_FILENO);
+    std::unordered_map<pid_t, JobSample> samples;
+    smash.interrupt_requested = false;
 
-    // Split command into two usable parts
-    PipeCommandIntoTwoParts(&string_cmd_line, this->type, &command1, &command2);
+    for (long tick = 0; ticks < 0 || tick < ticks; tick++)
+    {
+        smash.jobsList->removeFinishedJobs();
+        std::map<int, JobEntry *> &jobs = smash.jobsList->jobsList->byID;
+        long long now_ms = TimerWheel::nowMs();
+
+        if (tty)
+        {
+            // home and clear, the table is redrawn in place
+            std::cout << "\033[H\033[2J";
+        }
+        else if (tick > 0)
+        {
+            std::cout << std::endl;
+        }
+        std::cout << std::left << std::setw(5) << "JOB" << std::setw(8) << "PID" << std::setw(3) << "S"
+                  << std::right << std::setw(7) << "CPU%" << std::setw(10) << "RSS(KB)" << std::setw(12) << "READ/s"
+                  << std::setw(12) << "WRITE/s" << std::setw(10) << "ELAPSED" << "  COMMAND" << std::endl;
+
+        std::unordered_map<pid_t, JobSample> seen;
+        for (std::map<int, JobEntry *>::iterator it = jobs.begin(); it != jobs.end(); it++)
+        {
+            JobEntry *job = it->second;
+            std::unordered_map<pid_t, JobSample>::iterator found = samples.find(job->PID);
+            JobSample sample;
+            if (found != samples.end())
+            {
+                sample = found->second;
+                samples.erase(found);
+            }
+            else
+            {
+                sample.statFd = _openProcFile(job->PID, "stat");
+                sample.statmFd = _openProcFile(job->PID, "statm");
+                sample.ioFd = _openProcFile(job->PID, "io");
+                sample.sampled = false;
+            }
+
+            // stat: pid (comm) state ... utime stime are fields 14 and 15,
+            // comm may hold spaces so we count from its closing paren
+            char buffer[1024];
+            char state = '?';
+            unsigned long long cpu_ticks = 0;
+            if (_readProcFile(sample.statFd, job->PID, "stat", buffer, sizeof(buffer)))
+            {
+                const char *fields = strrchr(buffer, ')');
+                unsigned long long utime = 0;
+                unsigned long long stime = 0;
+                if (fields != nullptr &&
+                    sscanf(fields + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &state, &utime, &stime) == 3)
+                {
+                    cpu_ticks = utime + stime;
+                }
+            }
+            unsigned long long rss_kb = 0;
+            if (_readProcFile(sample.statmFd, job->PID, "statm", buffer, sizeof(buffer)))
+            {
+                unsigned long long size_pages = 0;
+                unsigned long long rss_pages = 0;
+                sscanf(buffer, "%llu %llu", &size_pages, &rss_pages);
+                rss_kb = rss_pages * page_kb;
+            }
+            unsigned long long read_bytes = 0;
+            unsigned long long write_bytes = 0;
+            if (_readProcFile(sample.ioFd, job->PID, "io", buffer, sizeof(buffer)))
+            {
+                const char *read_line = strstr(buffer, "\nread_bytes:");
+                const char *write_line = strstr(buffer, "\nwrite_bytes:");
+                read_bytes = read_line ? strtoull(read_line + 12, nullptr, 10) : 0;
+                write_bytes = write_line ? strtoull(write_line + 13, nullptr, 10) : 0;
+            }
+
+            // rates since the last tick, or since the job started on its first
+            long long elapsed_ms = now_ms - job->startedAtMs;
+            double cpu = 0;
+            double read_rate = 0;
+            double write_rate = 0;
+            if (sample.sampled && now_ms > sample.sampledAtMs)
+            {
+                double seconds = (now_ms - sample.sampledAtMs) / 1000.0;
+                cpu = (cpu_ticks - sample.cpuTicks) * 100.0 / clock_ticks / seconds;
+                read_rate = (read_bytes - sample.readBytes) / seconds;
+                write_rate = (write_bytes - sample.writeBytes) / seconds;
+            }
+            else if (elapsed_ms > 0)
+            {
+                cpu = cpu_ticks * 100.0 / clock_ticks / (elapsed_ms / 1000.0);
+            }
+            sample.cpuTicks = cpu_ticks;
+            sample.readBytes = read_bytes;
+            sample.writeBytes = write_bytes;
+            sample.sampledAtMs = now_ms;
+            sample.sampled = true;
+            seen[job->PID] = sample;
+
+            std::cout << std::left << std::setw(5) << job->jobID << std::setw(8) << job->PID << std::setw(3) << state
+                      << std::right << std::fixed << std::setprecision(1) << std::setw(7) << cpu
+                      << std::setw(10) << rss_kb << std::setprecision(0) << std::setw(12) << read_rate
+                      << std::setw(12) << write_rate << std::setw(10) << _formatElapsed((long)(elapsed_ms / 1000))
+                      << "  " << job->command << std::endl;
+        }
+        std::cout.unsetf(std::ios::floatfield | std::ios::adjustfield);
+        std::cout << std::setprecision(6);
+
+        // whatever is left in samples belongs to jobs that are gone
+        for (std::unordered_map<pid_t, JobSample>::iterator it = samples.begin(); it != samples.end(); it++)
+        {
+            _closeJobSample(&it->second);
+        }
+        samples.swap(seen);
 
-    // Create the two commands
-    Command *Command1 = smash.CreateCommand(command1.c_str());
-    Command *Command2 = smash.CreateCommand(command2.c_str());
+        if (jobs.empty() || (ticks >= 0 && tick + 1 >= ticks))
+        {
+            break;
+        }
+        // sleep through the event loop, SIGCHLD and ctrl-C keep being handled
+        long long wake_ms = now_ms + (long long)(interval * 1000);
+        while (!smash.interrupt_requested && TimerWheel::nowMs() < wake_ms)
+        {
+            smash.pollEvents(-1, (int)(wake_ms - TimerWheel::nowMs()));
+        }
+        if (smash.interrupt_requested)
+        {
+            break;
+        }
+    }
 
-    // Create the pipe that will be used
-    if (pipe(pipe_file_desc) == -1)
+    for (std::unordered_map<pid_t, JobSample>::iterator it = samples.begin(); it != samples.end(); it++)
     {
-        ::perror("smash error: pipe failed");
-        return;
+        _closeJobSample(&it->second);
     }
+    smash.interrupt_requested = false;
+}
+REGISTER_BUILTIN("jobtop", JobTopCommand);
+
+////////////////////////////////////////////////////////////////////////
+///                             #SmashStat                           ///
+////////////////////////////////////////////////////////////////////////
+
+#ifdef SMASH_STATS
+LatencyHistogram statPhases[NUM_STAT_PHASES];
 
-    // We will now fork twice, once for each CommandI, and execute the command
-    // on each process and for each one redirect the requested channel to the
-    // appropriate end of the pipe
+void LatencyHistogram::reset()
+{
+    memset(counts, 0, sizeof(counts));
+    total = 0;
+    max = 0;
+}
 
-    pid_t command_1_pid = fork();
+uint64_t LatencyHistogram::bucketTop(int bucket)
+{
+    if (bucket < LINEAR_BUCKETS)
+    {
+        return bucket;
+    }
+    int magnitude = (bucket - LINEAR_BUCKETS) / 16 + 5;
+    uint64_t sub = (bucket - LINEAR_BUCKETS) % 16 + 16;
+    int shift = magnitude - SUB_BUCKET_BITS;
+    return ((sub + 1) << shift) - 1;
+}
 
-    if (command_1_pid == -1)
+uint64_t LatencyHistogram::quantile(double q) const
+{
+    if (total == 0)
     {
-        perror("smash error: fork failed");
-        return;
+        return 0;
     }
-
-    if (command_1_pid == 0)
+    // the rank of the wanted value, 1 based
+    uint64_t rank = (uint64_t)(q * total + 0.5);
+    rank = (rank == 0) ? 1 : rank;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < NUM_BUCKETS; bucket++)
     {
-        if (setpgrp())
-        {
-            perror("smash error: setpgrp failed");
-            return;
-        }
-        // Command 1 proccess
-        // Close Read channel of pipe
-        //        if(close(pipe_file_desc[pipe_read]) == -1){
-        //            perror("smash error: close failed");
-        //            return;
-        //        }
-        // Redirect Write channel of pipe to STDOUT or STDERR
-        if (type == Fromstdout)
-        {
-            if (dup2(pipe_file_desc[pipe_write], STD_OUT_INDEX) == -1)
-            {
-                perror("smash error: dup2 failed");
-                return;
-            }
-        }
-        else if (type == Fromstderr)
-        {
-            if (dup2(pipe_file_desc[pipe_write], STD_ERR_INDEX) == -1)
-            {
-                perror("smash error: dup2 failed");
-                return;
-            }
-        }
-
-        // Close unneccesary channels
-        if (close(pipe_file_desc[pipe_read]) == -1)
-        {
-            perror("smash error: close failed");
-            return;
-        }
-        if (close(pipe_file_desc[pipe_write]) == -1)
+        seen += counts[bucket];
+        if (seen >= rank)
         {
-            perror("smash error: close failed");
-            return;
+            uint64_t top = bucketTop(bucket);
+            return (top < max) ? top : max;
         }
+    }
+    return max;
+}
 
-        // Then execute the appropriate command 1
-        smash.executeCommand(command1.c_str());
-        // if we are still here, failure
-
-        exit(EXIT_FAILURE);
+// 850ns, 12.3us, 4.56ms, 1.20s
+static std::string _formatNanos(uint64_t ns)
+{
+    char text[32];
+    if (ns < 1000)
+    {
+        snprintf(text, sizeof(text), "%lluns", (unsigned long long)ns);
+    }
+    else if (ns < 1000000)
+    {
+        snprintf(text, sizeof(text), "%.1fus", ns / 1e3);
+    }
+    else if (ns < 1000000000)
+    {
+        snprintf(text, sizeof(text), "%.2fms", ns / 1e6);
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "%.2fs", ns / 1e9);
     }
+    return text;
+}
 
-    pid_t command_2_pid = fork();
+static void _printHistogram(const std::string &name, const LatencyHistogram &histogram)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "%-12s %8llu %10s %10s %10s", name.c_str(), (unsigned long long)histogram.total,
+             _formatNanos(histogram.quantile(0.5)).c_str(), _formatNanos(histogram.quantile(0.99)).c_str(),
+             _formatNanos(histogram.max).c_str());
+    cout << line << endl;
+}
+#endif
 
-    if (command_2_pid == -1)
+/**
+ * smashstat [--reset]
+ * Prints count, p50, p99 and max latency of every phase and of every
+ * builtin that ran, or clears them with --reset. Only available when
+ * smash is built with SMASH_STATS (make STATS=1).
+ * #SmashStat
+ */
+void SmashStatCommand::execute()
+{
+    bool reset = (num_args == 2 && strcmp(args[1], "--reset") == 0);
+    if (num_args > 2 || (num_args == 2 && !reset))
     {
-        perror("smash error: fork failed");
+        cerr << "smash error: smashstat: invalid arguments" << endl;
         return;
     }
-
-    int STD_IN_INDEX = 0;
-
-    if (command_2_pid == 0)
+#ifdef SMASH_STATS
+    static const char *const PHASE_NAMES[NUM_STAT_PHASES] = {"command", "parse",    "dispatch", "spawn",
+                                                             "wait",    "external", "redirect", "pipe"};
+    BuiltinRegistry &registry = BuiltinRegistry::getInstance();
+    std::vector<std::string> names = registry.names();
+    if (reset)
     {
-        if (setpgrp())
+        for (int phase = 0; phase < NUM_STAT_PHASES; phase++)
         {
-            perror("smash error: setpgrp failed");
-            return;
+            statPhases[phase].reset();
         }
-
-        // Redirect Read channel of pipe to stdin of proccess 2
-        if (dup2(pipe_file_desc[pipe_read], STD_IN_INDEX) == -1)
+        for (const std::string &name : names)
         {
-            perror("smash error: dup2 failed");
-            return;
+            registry.statsFor(name)->reset();
         }
+        return;
+    }
 
-        // Close unneccesary channels
-        if (close(pipe_file_desc[pipe_read]) == -1)
-        {
-            perror("smash error: close failed");
-            return;
-        }
-        if (close(pipe_file_desc[pipe_write]) == -1)
+    char header[128];
+    snprintf(header, sizeof(header), "%-12s %8s %10s %10s %10s", "phase", "count", "p50", "p99", "max");
+    cout << header << endl;
+    for (int phase = 0; phase < NUM_STAT_PHASES; phase++)
+    {
+        _printHistogram(PHASE_NAMES[phase], statPhases[phase]);
+    }
+    snprintf(header, sizeof(header), "%-12s %8s %10s %10s %10s", "builtin", "count", "p50", "p99", "max");
+    cout << endl << header << endl;
+    for (const std::string &name : names)
+    {
+        const LatencyHistogram *histogram = registry.statsFor(name);
+        if (histogram->total > 0)
         {
-            perror("smash error: close failed");
-            return;
+            _printHistogram(name, *histogram);
         }
+    }
+#else
+    cerr << "smash error: smashstat: smash was built without SMASH_STATS" << endl;
+#endif
+}
+REGISTER_PURE_BUILTIN("smashstat", SmashStatCommand);
 
-        // Then execute the appropriate command 1
-        smash.executeCommand(command2.c_str());
-        // if we are still here, failure
+////////////////////////////////////////////////////////////////////////
+///                             #TimeCommand                         ///
+////////////////////////////////////////////////////////////////////////
 
-        exit(EXIT_FAILURE);
-    }
+static void _printDuration(const char *label, long long micros)
+{
+    char line[64];
+    snprintf(line, sizeof(line), "%s\t%lldm%lld.%03llds", label, micros / 60000000, (micros / 1000000) % 60,
+             (micros / 1000) % 1000);
+    cerr << line << endl;
+}
 
-    // Now for the parent proccess, we want to close both channels
+static long long _micros(const struct timeval &value)
+{
+    return (long long)value.tv_sec * 1000000 + value.tv_usec;
+}
 
-    // Close unneccesary channels
-    if (close(pipe_file_desc[pipe_read]) == -1)
+/**
+ * time command
+ * Runs command (a pipeline too) and reports on stderr, like bash: wall
+ * time, user and system CPU of the shell and of every child it waited
+ * for, the largest child RSS, context switches and the exit status.
+ * #TimeCommand
+ */
+void TimeCommand::execute()
+{
+    SmallShell &smash = SmallShell::getInstance();
+    if (num_tokens < 2)
     {
-        perror("smash error: close failed");
+        cerr << "smash error: time: invalid arguments" << endl;
         return;
     }
-    if (close(pipe_file_desc[pipe_write]) == -1)
+    Command *inner = smash.prepareCommand(cmd_line + tokens[1].start);
+    if (inner == nullptr)
     {
-        perror("smash error: close failed");
         return;
     }
 
-    if (waitpid(command_2_pid, nullptr, WUNTRACED) == -1 ||
-        waitpid(command_1_pid, nullptr, WUNTRACED) == -1)
-    {
-        perror("smash error: waitpid failed");
-        return;
-    }
+    struct rusage children;
+    memset(&children, 0, sizeof(children));
+    struct rusage self_before;
+    struct rusage self_after;
+    struct timespec start;
+    struct timespec end;
+    struct rusage *outer_sink = smash.rusage_sink;
+
+    smash.rusage_sink = &children;
+    getrusage(RUSAGE_SELF, &self_before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    inner->execute();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self_after);
+    smash.rusage_sink = outer_sink;
+    if (outer_sink != nullptr)
+    {
+        // time time cmd: the outer one sees the children as well
+        _addRusage(outer_sink, children);
+    }
+    if (!inner->ownedByJob)
+    {
+        delete inner;
+    }
+
+    long long real = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+    long long user = _micros(children.ru_utime) + _micros(self_after.ru_utime) - _micros(self_before.ru_utime);
+    long long sys = _micros(children.ru_stime) + _micros(self_after.ru_stime) - _micros(self_before.ru_stime);
+    long voluntary = children.ru_nvcsw + self_after.ru_nvcsw - self_before.ru_nvcsw;
+    long involuntary = children.ru_nivcsw + self_after.ru_nivcsw - self_before.ru_nivcsw;
+
+    cerr << endl;
+    _printDuration("real", real);
+    _printDuration("user", user);
+    _printDuration("sys", sys);
+    cerr << "maxrss\t" << children.ru_maxrss << " KB" << endl;
+    cerr << "csw\t" << voluntary << " voluntary, " << involuntary << " involuntary" << endl;
+    cerr << "status\t" << smash.last_status << endl;
 }
+REGISTER_BUILTIN("time", TimeCommand);
 
 ////////////////////////////////////////////////////////////////////////
-///                              #SetCore                             ///
+///                           #ParallelCommand                       ///
 ////////////////////////////////////////////////////////////////////////
 
-// Simple Auxiliary function that checks if a given char* is a number
-bool TextIsNumber(const char *text)
+// One line parallel runs, in input order
+struct ParallelJob
 {
-    int pos = 0;
-    char NULL_TERM = '\0';
-    while (text[pos] != NULL_TERM)
+    std::string line;
+    pid_t pid;
+    int outputFd; // -k: the job's stdout, kept until its turn to be printed
+    bool done;
+    int status;
+};
+
+// arg as one word for the lexer: 'arg', a ' inside becomes '\''
+static std::string _shellQuote(const std::string &arg)
+{
+    std::string quoted = "'";
+    for (size_t i = 0; i < arg.size(); i++)
     {
-        if (!isdigit(text[pos]))
-        {
-            return false;
-        }
-        pos++;
+        quoted += (arg[i] == '\'') ? std::string("'\\''") : std::string(1, arg[i]);
     }
-    return true;
+    return quoted + "'";
 }
 
-void SetcoreCommand::execute()
+// Every {} in the template becomes arg, without one arg goes at the end
+static std::string _fillTemplate(const std::string &templ, const std::string &arg)
 {
-    SmallShell &smash = SmallShell::getInstance();
-    char *job_id = args[1];
-    char *requested_cpu = args[2];
-    int online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    std::string quoted = _shellQuote(arg);
+    std::string line;
+    size_t from = 0;
+    size_t at;
+    while ((at = templ.find("{}", from)) != std::string::npos)
+    {
+        line.append(templ, from, at - from);
+        line += quoted;
+        from = at + 2;
+    }
+    if (from == 0)
+    {
+        return templ + " " + quoted;
+    }
+    return line + templ.substr(from);
+}
 
-    if (TextIsNumber(job_id))
+// An unlinked file for a job's output under -k
+static int _openOutputFile()
+{
+    int fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1)
     {
-        if (smash.jobsList->getJobById(atoi(job_id)) == nullptr)
-        {
-            std::cerr << "smash error: setcore: job-id " << job_id
-                      << " does not exist" << std::endl;
-            return;
-        }
+        return fd;
     }
-    else
+    char path[] = "/tmp/smash_parallelXXXXXX";
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1)
     {
-        std::cerr << "smash error: setcore: invalid arguments" << endl;
-        return;
+        _perror("smash error: mkstemp failed");
+        return -1;
     }
+    unlink(path);
+    return fd;
+}
 
-    if (TextIsNumber(requested_cpu))
+// Copies what a -k job wrote to our stdout, then closes its file
+static void _printOutputFile(int fd)
+{
+    char buffer[64 * 1024];
+    ssize_t got;
+    off_t offset = 0;
+    while ((got = pread(fd, buffer, sizeof(buffer), offset)) > 0)
     {
-        int requested_cpu_num = atoi(requested_cpu);
-        if (requested_cpu_num < 0 || requested_cpu_num >= online_cpus)
+        offset += got;
+        for (ssize_t written = 0; written < got;)
         {
-            std::cerr << "smash error: setcore: invalid core number"
-                      << std::endl;
-            return;
+            ssize_t res = write(STDOUT_FILENO, buffer + written, got - written);
+            if (res == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (res == -1)
+            {
+                _perror("smash error: write failed");
+                close(fd);
+                return;
+            }
+            written += res;
         }
     }
-    else
+    if (got == -1)
     {
-        std::cerr << "smash error: setcore: invalid arguments" << endl;
-        return;
+        _perror("smash error: read failed");
     }
+    close(fd);
+}
 
-    if (!(TextIsNumber(requested_cpu)) || !(TextIsNumber(job_id)) ||
-        (args[3] != nullptr))
+// Starts one job with stdin from input_fd and stdout to its output file,
+// if it has one. External commands are spawned directly, anything else
+// (builtins, pipelines, redirections) runs in a forked copy of the shell.
+static pid_t _launchParallelJob(ParallelJob *job, int input_fd)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    Command *cmd = smash.prepareCommand(job->line.c_str());
+    if (cmd == nullptr)
     {
-        std::cerr << "smash error: setcore: invalid arguments" << std::endl;
-        return;
+        return 0;
     }
-
-    int requested_cpu_num = atoi(requested_cpu);
-    JobEntry *requested_job = smash.jobsList->getJobById(atoi(job_id));
-
-    cpu_set_t cpu;
-    CPU_ZERO(&cpu);
-    CPU_SET(requested_cpu_num, &cpu);
-
-    if (sched_setaffinity(requested_job->PID, sizeof(cpu), &cpu) == -1)
+    ExternalCommand *external = dynamic_cast<ExternalCommand *>(cmd);
+    pid_t pid;
+    if (external != nullptr && !_isBackgroundComamnd(cmd->cmd_line))
+    {
+        pid = external->spawn(input_fd, job->outputFd, -1);
+    }
+    else
     {
-        // TODO review errors, are they what is expected?
-        if (errno == ESRCH)
+        smash.flushOutput();
+        pid = fork();
+        if (pid == -1)
         {
-            std::cerr << "smash error: setcore: job-id " << job_id
-                      << " does not exist" << std::endl;
-            return;
+            _perror("smash error: fork failed");
         }
-        else if (errno == EINVAL)
+        else if (pid == 0)
         {
-            std::cerr << "smash error: setcore: invalid core number"
-                      << std::endl;
-            return;
+            setpgrp();
+            smash.leaveEventLoop();
+            if (dup2(input_fd, STDIN_FILENO) == -1 ||
+                (job->outputFd != -1 && dup2(job->outputFd, STDOUT_FILENO) == -1))
+            {
+                _perror("smash error: dup2 failed");
+                exit(EXIT_FAILURE);
+            }
+            smash.last_status = 0;
+            cmd->execute();
+            smash.flushOutput();
+            exit(smash.last_status);
         }
-        perror("smash error: sched_setaffinity failed");
-        return;
     }
+    delete cmd;
+    return pid;
 }
 
-////////////////////////////////////////////////////////////////////////
-///                            #GetFileTypeCommand                   ///
-////////////////////////////////////////////////////////////////////////
-
-void GetFileTypeCommand::execute()
+/**
+ * parallel [-j N] [-k] template [::: arg...]
+ * Runs template once per arg, with {} replaced by the (quoted) arg or the
+ * arg appended when there is no {}, keeping at most N (default: online
+ * CPUs) of them running. Without ::: the args are the lines of stdin. -k
+ * prints every job's output in input order instead of as it comes. Jobs
+ * read /dev/null. Failed jobs are listed at the end; the status is their
+ * count, up to 101.
+ * #ParallelCommand
+ */
+void ParallelCommand::execute()
 {
-    struct stat file_info;
-    char *file_path = args[1];
-
-    if (this->args[2] != nullptr)
+    SmallShell &smash = SmallShell::getInstance();
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    bool keep_order = false;
+    int first = 1;
+    for (; first < num_tokens && tokens[first].type == TokenWord && !tokens[first].quoted; first++)
     {
-        cerr << "smash error: gettype: invalid arguments" << endl;
-        return;
+        const char *word = tokens[first].text;
+        if (strcmp(word, "-k") == 0)
+        {
+            keep_order = true;
+        }
+        else if (strcmp(word, "-j") == 0)
+        {
+            if (first + 1 >= num_tokens || !TextIsNumber(tokens[first + 1].text) || atol(tokens[first + 1].text) <= 0)
+            {
+                cerr << "smash error: parallel: invalid arguments" << endl;
+                return;
+            }
+            slots = atol(tokens[++first].text);
+        }
+        else
+        {
+            break;
+        }
     }
 
-    if (this->args[1] == nullptr)
+    // the template is the source text up to :::, so its quoting survives
+    int separator = first;
+    int last = first;
+    for (; separator < num_tokens; separator++)
     {
-        cerr << "smash error: gettype: invalid arguments" << endl;
-        return;
+        if (tokens[separator].type == TokenWord && !tokens[separator].quoted &&
+            strcmp(tokens[separator].text, ":::") == 0)
+        {
+            break;
+        }
+        if (tokens[separator].type != TokenBackground)
+        {
+            last = separator + 1;
+        }
     }
-
-    if (stat(file_path, &file_info) == -1)
+    if (last == first || tokens[first].type != TokenWord)
     {
-
-        perror("smash error: stat failed");
+        cerr << "smash error: parallel: invalid arguments" << endl;
         return;
     }
+    std::string templ(cmd_line + tokens[first].start, tokens[last - 1].end - tokens[first].start);
 
-    std::cout << file_path << "'s type is \"";
-
-    if (S_ISREG(file_info.st_mode))
-    {
-        std::cout << "regular file";
-    }
-    else if (S_ISDIR(file_info.st_mode))
+    std::vector<std::string> inputs;
+    if (separator < num_tokens)
     {
-        std::cout << "directory";
+        for (int i = separator + 1; i < num_tokens; i++)
+        {
+            if (tokens[i].type == TokenWord)
+            {
+                inputs.push_back(tokens[i].text);
+            }
+        }
     }
-    else if (S_ISCHR(file_info.st_mode))
+    else
     {
-        std::cout << "character device";
+        LineReader reader(STDIN_FILENO);
+        std::string line;
+        while (reader.readLine(&line))
+        {
+            inputs.push_back(line);
+        }
     }
-    else if (S_ISBLK(file_info.st_mode))
+
+    std::vector<ParallelJob> jobs(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++)
     {
-        std::cout << "block device";
+        jobs[i].line = _fillTemplate(templ, inputs[i]);
+        jobs[i].pid = -1;
+        jobs[i].outputFd = -1;
+        jobs[i].done = false;
+        jobs[i].status = 0;
     }
-    else if (S_ISFIFO(file_info.st_mode))
+
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (null_fd == -1)
     {
-        std::cout << "FIFO";
+        _perror("smash error: open failed");
+        return;
     }
-    else if (S_ISLNK(file_info.st_mode))
+    std::map<pid_t, size_t> running;
+    size_t next = 0;
+    size_t next_to_print = 0;
+    bool interrupted = false;
+    smash.interrupt_requested = false;
+
+    while (next < jobs.size() || !running.empty())
     {
-        std::cout << "symbolic link";
+        while (!interrupted && next < jobs.size() && (long)running.size() < slots)
+        {
+            ParallelJob &job = jobs[next++];
+            job.outputFd = keep_order ? _openOutputFile() : -1;
+            job.pid = _launchParallelJob(&job, null_fd);
+            if (job.pid > 0)
+            {
+                running[job.pid] = &job - &jobs[0];
+                continue;
+            }
+            // an empty line succeeds, a failed launch counts as not found
+            job.done = true;
+            job.status = (job.pid == 0) ? 0 : W_EXITCODE(127, 0);
+        }
+
+        // reap ours directly, one that removeFinishedJobs got to first waits
+        // in reapedChildren
+        bool reaped = false;
+        for (std::map<pid_t, size_t>::iterator it = running.begin(); it != running.end();)
+        {
+            ParallelJob &job = jobs[it->second];
+            struct rusage usage;
+            memset(&usage, 0, sizeof(usage));
+            pid_t res = wait4(it->first, &job.status, WNOHANG, &usage);
+            if (res == 0 || (res == -1 && errno == EINTR))
+            {
+                it++;
+                continue;
+            }
+            if (res == -1 && !smash.jobsList->takeReapedStatus(it->first, &job.status, &usage))
+            {
+                _perror("smash error: wait4 failed");
+                job.status = W_EXITCODE(127, 0);
+            }
+            if (smash.rusage_sink != nullptr)
+            {
+                _addRusage(smash.rusage_sink, usage);
+            }
+            job.done = true;
+            reaped = true;
+            running.erase(it++);
+        }
+
+        while (next_to_print < next && jobs[next_to_print].done)
+        {
+            ParallelJob &job = jobs[next_to_print++];
+            if (job.outputFd != -1)
+            {
+                smash.flushOutput();
+                _printOutputFile(job.outputFd);
+                job.outputFd = -1;
+            }
+        }
+
+        if (smash.interrupt_requested && !interrupted)
+        {
+            // ctrl-C: what runs is killed, what didn't start never will
+            interrupted = true;
+            for (std::map<pid_t, size_t>::iterator it = running.begin(); it != running.end(); it++)
+            {
+                kill(it->first, SIGKILL);
+            }
+            next_to_print = next;
+        }
+        if (interrupted && running.empty())
+        {
+            break;
+        }
+        if (!reaped && !running.empty() && smash.eventLoopRunning())
+        {
+            smash.pollEvents(-1);
+        }
+        else if (!reaped && !running.empty())
+        {
+            // a forked pipeline stage has no signalfd to wake it, block until
+            // a child exits and reap it above
+            siginfo_t info;
+            while (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) == -1 && errno == EINTR)
+            {
+            }
+        }
     }
-    else if (S_ISSOCK(file_info.st_mode))
+    close(null_fd);
+    for (size_t i = 0; i < jobs.size(); i++)
     {
-        std::cout << "socket";
+        if (jobs[i].outputFd != -1)
+        {
+            close(jobs[i].outputFd);
+        }
     }
 
-    std::cout << "\" and takes up " << file_info.st_size << " bytes" << endl;
-}
-
-////////////////////////////////////////////////////////////////////////
-///                            #ChmodCommand                        ///
-////////////////////////////////////////////////////////////////////////
-void ChmodCommand::execute()
-{
-    // SmallShell& smash = SmallShell::getInstance();
-    if (args[3] != nullptr)
+    int failed = 0;
+    for (size_t i = 0; i < next; i++)
     {
-        cerr << "smash error: chmod: invalid arguments" << endl;
-        return;
+        int status = jobs[i].status;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        {
+            continue;
+        }
+        failed++;
+        if (WIFSIGNALED(status))
+        {
+            cerr << "smash: parallel: " << jobs[i].line << " was killed by signal " << WTERMSIG(status) << endl;
+        }
+        else
+        {
+            cerr << "smash: parallel: " << jobs[i].line << " exited with status " << WEXITSTATUS(status) << endl;
+        }
     }
-    if (!TextIsNumber(args[1]))
+    if (interrupted && next < jobs.size())
     {
-        cerr << "smash error: chmod: invalid arguments" << endl;
-        return;
+        cerr << "smash: parallel: " << jobs.size() - next << " jobs were not started" << endl;
     }
-
-    int mode = std::stoi(args[1], nullptr, 8);
-
-    char *file_path = args[2];
-
-    if (chmod(file_path, mode) == -1)
+    if (failed > 0)
     {
-        perror("smash error: chmod failed");
-        return;
+        cerr << "smash: parallel: " << failed << " of " << next << " jobs failed" << endl;
     }
-}
\ No newline at end of file
+    smash.last_status = (failed > 101) ? 101 : failed;
+}
+REGISTER_BUILTIN("parallel", ParallelCommand);
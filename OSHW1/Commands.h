@@ -3,26 +3,183 @@
 
 #include <vector>
 #include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
 #include <algorithm>
 #include <unistd.h>
 #include <string>
+#include <sys/stat.h>
+#include <streambuf>
+#include <ostream>
+#include <signal.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <time.h>
 
 #define COMMAND_ARGS_MAX_LENGTH (200)
 #define COMMAND_MAX_ARGS (20)
 #define PATH_MAX (1024)
 
+// Bump allocator for everything one command line is parsed into: the line
+// copy, the argv vector and the tokens. The first INLINE_SIZE bytes live
+// inside the arena itself, so a typical line costs no heap allocation, and
+// everything is released at once by reset().
+class CommandArena
+{
+    static const size_t INLINE_SIZE = 512;
+    static const size_t CHUNK_SIZE = 4096;
+    char inlineBuf[INLINE_SIZE];
+    char *chunks; // overflow chunks, each starts with a pointer to the previous
+    char *cursor;
+    size_t remaining;
+
+public:
+    CommandArena() : chunks(nullptr), cursor(inlineBuf), remaining(INLINE_SIZE) {}
+    ~CommandArena() { reset(); }
+    CommandArena(CommandArena const &) = delete;
+    void operator=(CommandArena const &) = delete;
+    void *allocate(size_t size);
+    char *copyString(const char *str, size_t length);
+    void reset();
+};
+
+enum TokenType
+{
+    TokenWord,
+    TokenRedirect,   // >
+    TokenAppend,     // >>
+    TokenPipe,       // |
+    TokenPipeErr,    // |&
+    TokenBackground  // &
+};
+
+struct Token
+{
+    TokenType type;
+    const char *text; // the word with quotes and escapes removed
+    int start;        // [start, end) of the token in the source line
+    int end;
+    bool quoted;      // part of the word was quoted, it is never globbed
+};
+
+#ifdef SMASH_STATS
+// Log-linear latency histogram in the style of HdrHistogram, for smashstat.
+// Values under 32ns get a bucket each; above that every power of two is
+// split into 16 buckets, so a reported value is at most 1/16 too high.
+class LatencyHistogram
+{
+public:
+    static const int LINEAR_BUCKETS = 32;
+    static const int SUB_BUCKET_BITS = 4; // 16 buckets per power of two
+    static const int NUM_BUCKETS = LINEAR_BUCKETS + (64 - 5) * 16;
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+
+    LatencyHistogram() { reset(); }
+    void reset();
+    void record(uint64_t ns)
+    {
+        counts[bucketOf(ns)]++;
+        total++;
+        max = (ns > max) ? ns : max;
+    }
+    // the highest value of the bucket holding the given quantile (0..1)
+    uint64_t quantile(double q) const;
+    static int bucketOf(uint64_t ns)
+    {
+        if (ns < LINEAR_BUCKETS)
+        {
+            return (int)ns;
+        }
+        int magnitude = 63 - __builtin_clzll(ns);
+        int shift = magnitude - SUB_BUCKET_BITS;
+        return LINEAR_BUCKETS + (magnitude - 5) * 16 + (int)((ns >> shift) - 16);
+    }
+    static uint64_t bucketTop(int bucket);
+};
+
+// The phases every command line goes through
+enum StatPhase
+{
+    StatCommand,  // executeCommand, the whole line
+    StatParse,    // lexing
+    StatDispatch, // CreateCommand: operator scan, builtin lookup, argv
+    StatSpawn,    // fork, or posix_spawn which returns after the exec
+    StatWait,     // _waitChild
+    StatExternal, // ExternalCommand::execute
+    StatRedirect, // RedirectionCommand::execute
+    StatPipe,     // PipeCommand::execute
+    NUM_STAT_PHASES
+};
+extern LatencyHistogram statPhases[NUM_STAT_PHASES];
+
+inline uint64_t _statNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Records the time from construction to the end of the scope
+class StatProbe
+{
+    LatencyHistogram *histogram;
+    uint64_t start;
+
+public:
+    explicit StatProbe(LatencyHistogram *histogram)
+        : histogram(histogram), start(histogram != nullptr ? _statNow() : 0) {}
+    ~StatProbe()
+    {
+        if (histogram != nullptr)
+        {
+            histogram->record(_statNow() - start);
+        }
+    }
+};
+
+#define SMASH_STAT_CONCAT_(a, b) a##b
+#define SMASH_STAT_CONCAT(a, b) SMASH_STAT_CONCAT_(a, b)
+#define SMASH_PROBE(phase) StatProbe SMASH_STAT_CONCAT(stat_probe_, __LINE__)(&statPhases[phase])
+#define SMASH_PROBE_INTO(histogram) StatProbe SMASH_STAT_CONCAT(stat_probe_, __LINE__)(histogram)
+#else
+// Built without SMASH_STATS the probes are not there at all
+#define SMASH_PROBE(phase)
+#define SMASH_PROBE_INTO(histogram)
+#endif
+
+// Tokens of an already lexed line, handed to a Command so it doesn't lex
+// the same line again. The default (count == -1) means "lex it yourself".
+struct TokenList
+{
+    const Token *tokens;
+    int count;
+    TokenList() : tokens(nullptr), count(-1) {}
+    TokenList(const Token *tokens, int count) : tokens(tokens), count(count) {}
+};
+
 class Command
 {
     // TODO: Add your data members
 public:
+    CommandArena arena;
     char *cmd_line;
+    Token *tokens;
+    int num_tokens;
     char **args;
     int num_args;
+    // set once a job refers to this command, the job then owns it
+    bool ownedByJob;
+#ifdef SMASH_STATS
+    LatencyHistogram *stats; // the builtin's own histogram, null otherwise
+#endif
 
 public:
     // Command() = default;
-    Command(const char *cmd_line);
-    ~Command();
+    Command(const char *cmd_line, TokenList lexed = TokenList());
+    virtual ~Command();
     virtual void execute() = 0;
     // virtual void prepare();
     // virtual void cleanup();
@@ -32,15 +189,16 @@ public:
 class BuiltInCommand : public Command
 {
 public:
-    BuiltInCommand(const char *cmd_line) : Command(cmd_line) {}
+    BuiltInCommand(const char *cmd_line, TokenList lexed = TokenList()) : Command(cmd_line, lexed) {}
 };
 
 class ExternalCommand : public Command
 {
 public:
-    ExternalCommand(const char *cmd_line); // in cpp
+    ExternalCommand(const char *cmd_line, TokenList lexed = TokenList()); // in cpp
     // virtual ~ExternalCommand() {}
     void execute() override;
+    pid_t spawn(int fd_in = -1, int fd_out = -1, int fd_err = -1);
 };
 
 enum PipeType
@@ -54,7 +212,7 @@ class PipeCommand : public Command
     PipeType type;
 
 public:
-    PipeCommand(const char *cmd_line, PipeType type) : Command(cmd_line), type(type) {}
+    PipeCommand(const char *cmd_line, PipeType type, TokenList lexed = TokenList()) : Command(cmd_line, lexed), type(type) {}
     // virtual ~PipeCommand() {}
     void execute() override;
 };
@@ -71,7 +229,7 @@ class RedirectionCommand : public Command
     RedirectType type;
 
 public:
-    explicit RedirectionCommand(const char *cmd_line, RedirectType type) : Command(cmd_line), type(type) {}
+    explicit RedirectionCommand(const char *cmd_line, RedirectType type, TokenList lexed = TokenList()) : Command(cmd_line, lexed), type(type) {}
     // virtual ~RedirectionCommand() {}
     void execute() override;
     // void prepare() override;
@@ -82,7 +240,7 @@ class ChangePromptCommand : public BuiltInCommand
 { // V
   // TODO: Add your data members public:
 public:
-    ChangePromptCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    ChangePromptCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~ChangePromptCommand() {}
     void execute() override;
 };
@@ -91,7 +249,7 @@ class ChangeDirCommand : public BuiltInCommand
 { // cd
   // TODO: Add your data members public:
 public:
-    ChangeDirCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    ChangeDirCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~ChangeDirCommand() {}
     void execute() override;
 };
@@ -99,7 +257,7 @@ public:
 class GetCurrDirCommand : public BuiltInCommand
 { // pwd
 public:
-    GetCurrDirCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    GetCurrDirCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~GetCurrDirCommand() {}
     void execute() override;
 };
@@ -107,17 +265,29 @@ public:
 class ShowPidCommand : public BuiltInCommand
 { // V showpid
 public:
-    ShowPidCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    ShowPidCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~ShowPidCommand() {}
     void execute() override;
 };
 
+class SourceCommand : public BuiltInCommand
+{
+    // source inside a sourced file nests, stop runaway recursion here
+    static const int MAX_DEPTH = 64;
+    static int depth;
+
+public:
+    SourceCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
+    // virtual ~SourceCommand() {}
+    void execute() override;
+};
+
 class JobsList;
 class QuitCommand : public BuiltInCommand
 {
     // TODO: Add your data members
 public:
-    QuitCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    QuitCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~QuitCommand() {}
     void execute() override;
 };
@@ -134,6 +304,9 @@ public:
 
     bool isStopped;
     bool isBackground;
+    long long startedAtMs; // CLOCK_MONOTONIC, for the wall time
+    int lastStatus;        // the last wait status wait4 gave us, -1 before the first
+    struct rusage usage;   // and the rusage that came with it
 
     // bool isComplex
     friend class JobStack;
@@ -142,19 +315,51 @@ public:
     JobEntry(int jobID, pid_t PID, const char *command, time_t startTime, Command *cmnd, bool isStopped = false);
 };
 
-class JobStack : public std::list<JobEntry *>
+// Slab storage for JobEntry objects. Entries are carved out of fixed-size
+// chunks and recycled through a free list, so adding and removing jobs
+// doesn't go to the heap once the pool has warmed up.
+class JobPool
 {
+    static const size_t CHUNK_ENTRIES = 256;
+    std::vector<char *> chunks;
+    std::vector<JobEntry *> freeList;
+
 public:
-    JobStack() : std::list<JobEntry *>() {}
-    ~JobStack()
-    {
-        while (!empty())
-        {
-            JobEntry *entry = back();
-            pop_back();
-            delete entry;
-        }
-    }
+    JobPool() : chunks(), freeList() {}
+    ~JobPool();
+    JobPool(JobPool const &) = delete;
+    void operator=(JobPool const &) = delete;
+    JobEntry *allocate(int jobID, pid_t PID, const char *command, time_t startTime, Command *cmnd, bool isStopped);
+    void release(JobEntry *entry);
+};
+
+// The job table: ordered by job-id for listing and "last job", hashed by
+// PID for SIGCHLD lookups, with a separate index of the stopped jobs.
+class JobStack
+{
+public:
+    std::map<int, JobEntry *> byID;
+    std::unordered_map<pid_t, JobEntry *> byPID;
+    std::set<int> stoppedIDs;
+    JobPool pool;
+
+    JobStack() : byID(), byPID(), stoppedIDs(), pool() {}
+    ~JobStack() { clear(); }
+    JobEntry *insert(int jobID, pid_t PID, const char *command, time_t startTime, Command *cmnd, bool isStopped);
+    void erase(JobEntry *entry);
+    void setStopped(JobEntry *entry, bool isStopped);
+    JobEntry *findById(int jobID);
+    JobEntry *findByPID(pid_t PID);
+    bool empty() const { return byID.empty(); }
+    size_t size() const { return byID.size(); }
+    void clear();
+};
+
+// What wait4 reported for a child
+struct ChildReport
+{
+    int status;
+    struct rusage usage;
 };
 
 class JobsList
@@ -164,12 +369,18 @@ public:
     // JobStack* StoppedJobs;
     JobStack *jobsList;
     int maxJobID;
+    // Children reaped by removeFinishedJobs that are not jobs: exit statuses
+    // of foreground/pipeline children, claimed by whoever waits for them.
+    std::map<pid_t, ChildReport> reapedChildren;
+    // Jobs dropped from the list before their process was reaped
+    std::set<pid_t> abandonedPIDs;
 
 public:
-    JobsList() : jobsList(new JobStack()), maxJobID(1) {}
+    JobsList() : jobsList(new JobStack()), maxJobID(1), reapedChildren(), abandonedPIDs() {}
     ~JobsList(); // default
     void addJob(Command *cmd, pid_t job_pid, bool isStopped = false);
-    void printJobsList();
+    // details: the pid, the last wait report and the wall time of each job
+    void printJobsList(bool details = false);
     void killAllJobs();
     void removeFinishedJobs();
     JobEntry *getJobById(int jobId);
@@ -177,6 +388,9 @@ public:
     void removeJobById(int jobId);
     JobEntry *getLastJob(int *lastJobId);
     JobEntry *getLastStoppedJob(int *jobId);
+    bool takeReapedStatus(pid_t pid, int *status, struct rusage *usage = nullptr);
+    void setStopped(JobEntry *entry, bool isStopped);
+    void updateMaxJobID();
     // TODO: Add extra methods or modify exisitng ones as needed
 };
 
@@ -200,7 +414,7 @@ class JobsCommand : public BuiltInCommand
 {
     // TODO: Add your data members
 public:
-    JobsCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    JobsCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~JobsCommand() {}
     void execute() override;
 };
@@ -209,7 +423,7 @@ class ForegroundCommand : public BuiltInCommand
 {
     // TODO: Add your data members
 public:
-    ForegroundCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    ForegroundCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~ForegroundCommand() {}
     void execute() override;
 };
@@ -218,7 +432,7 @@ class BackgroundCommand : public BuiltInCommand
 {
     // TODO: Add your data members
 public:
-    BackgroundCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    BackgroundCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~BackgroundCommand() {}
     void execute() override;
 };
@@ -228,7 +442,7 @@ class TimeoutCommand : public BuiltInCommand
     /* Bonus */
     // TODO: Add your data members
 public:
-    explicit TimeoutCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    explicit TimeoutCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~TimeoutCommand() {}
     void execute() override;
 };
@@ -237,16 +451,59 @@ class ChmodCommand : public BuiltInCommand
 {
     // TODO: Add your data members
 public:
-    ChmodCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    ChmodCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~ChmodCommand() {}
     void execute() override;
 };
 
+class CopyCommand : public BuiltInCommand
+{
+    // Most copies are queued to a pool of at most this many threads
+    static const unsigned MAX_WORKERS = 8;
+
+public:
+    CopyCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
+    // virtual ~CopyCommand() {}
+    void execute() override;
+};
+
+class SmashStatCommand : public BuiltInCommand
+{
+public:
+    SmashStatCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
+    // virtual ~SmashStatCommand() {}
+    void execute() override;
+};
+
+class ParallelCommand : public BuiltInCommand
+{
+public:
+    ParallelCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
+    // virtual ~ParallelCommand() {}
+    void execute() override;
+};
+
+class TimeCommand : public BuiltInCommand
+{
+public:
+    TimeCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
+    // virtual ~TimeCommand() {}
+    void execute() override;
+};
+
+class JobTopCommand : public BuiltInCommand
+{
+public:
+    JobTopCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
+    // virtual ~JobTopCommand() {}
+    void execute() override;
+};
+
 class GetFileTypeCommand : public BuiltInCommand
 {
     // TODO: Add your data members
 public:
-    GetFileTypeCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    GetFileTypeCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~GetFileTypeCommand() {}
     void execute() override;
 };
@@ -255,7 +512,7 @@ class SetcoreCommand : public BuiltInCommand
 {
     // TODO: Add your data members
 public:
-    SetcoreCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    SetcoreCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~SetcoreCommand() {}
     void execute() override;
 };
@@ -264,17 +521,333 @@ class KillCommand : public BuiltInCommand
 {
     // TODO: Add your data members
 public:
-    KillCommand(const char *cmd_line) : BuiltInCommand(cmd_line) {}
+    KillCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
     // virtual ~KillCommand() {}
     void execute() override;
 };
 
+class HashCommand : public BuiltInCommand
+{
+public:
+    HashCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
+    // virtual ~HashCommand() {}
+    void execute() override;
+};
+
+// bash-style cache of command name -> absolute path, so a launch doesn't walk
+// $PATH with a string of failing execve calls. Entries are dropped when PATH
+// changes or when a directory up to (and including) the hit's directory has
+// a new mtime, i.e. when a binary was added, removed or renamed there.
+class CommandHash
+{
+public:
+    struct HashEntry
+    {
+        std::string path;
+        size_t dirIndex;
+        int hits;
+    };
+    std::map<std::string, HashEntry> table;
+    std::string cachedPath;
+    std::vector<std::string> dirs;
+    std::vector<struct timespec> dirMtimes;
+
+    CommandHash() : cachedPath(), dirs(), dirMtimes() {}
+    bool lookup(const std::string &name, std::string *path);
+    bool warm(const std::string &name);
+    void clear();
+    void printTable();
+
+private:
+    void syncPath();
+    bool dirsUnchanged(size_t upTo);
+    bool search(const std::string &name, HashEntry *entry);
+};
+
+class AliasCommand : public BuiltInCommand
+{
+public:
+    AliasCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
+    // virtual ~AliasCommand() {}
+    void execute() override;
+};
+
+class UnaliasCommand : public BuiltInCommand
+{
+public:
+    UnaliasCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
+    // virtual ~UnaliasCommand() {}
+    void execute() override;
+};
+
+class BuiltinsCommand : public BuiltInCommand
+{
+public:
+    BuiltinsCommand(const char *cmd_line, TokenList lexed = TokenList()) : BuiltInCommand(cmd_line, lexed) {}
+    // virtual ~BuiltinsCommand() {}
+    void execute() override;
+};
+
+typedef Command *(*CommandFactory)(const char *cmd_line, TokenList lexed);
+
+template <class T>
+Command *_createBuiltin(const char *cmd_line, TokenList lexed)
+{
+    return new T(cmd_line, lexed);
+}
+
+// Name -> factory table CreateCommand dispatches builtins through. Every
+// builtin adds itself with REGISTER_BUILTIN next to its implementation, so
+// dispatch is one hash lookup no matter how many builtins there are.
+// Builtins registered with REGISTER_PURE_BUILTIN only read shell state and
+// write output; a pipeline runs them inside the shell instead of forking.
+// time is registered like any builtin, but CreateCommand dispatches it
+// ahead of pipes and redirections, since it times the whole line.
+class BuiltinRegistry
+{
+    struct BuiltinEntry
+    {
+        CommandFactory factory;
+        bool pure;
+#ifdef SMASH_STATS
+        LatencyHistogram *stats;
+#endif
+    };
+    std::unordered_map<std::string, BuiltinEntry> table;
+
+    BuiltinRegistry() : table() {}
+
+public:
+    BuiltinRegistry(BuiltinRegistry const &) = delete;
+    void operator=(BuiltinRegistry const &) = delete;
+    static BuiltinRegistry &getInstance()
+    {
+        // function local, so registration from other static objects is safe
+        static BuiltinRegistry instance;
+        return instance;
+    }
+    void add(const char *name, CommandFactory factory, bool pure)
+    {
+#ifdef SMASH_STATS
+        BuiltinEntry entry = {factory, pure, new LatencyHistogram()};
+#else
+        BuiltinEntry entry = {factory, pure};
+#endif
+        table[name] = entry;
+    }
+    CommandFactory find(const std::string &name) const
+    {
+        std::unordered_map<std::string, BuiltinEntry>::const_iterator it = table.find(name);
+        return it == table.end() ? nullptr : it->second.factory;
+    }
+    bool isPure(const std::string &name) const
+    {
+        std::unordered_map<std::string, BuiltinEntry>::const_iterator it = table.find(name);
+        return it != table.end() && it->second.pure;
+    }
+    std::vector<std::string> names() const;
+#ifdef SMASH_STATS
+    // the histogram of the builtin's executions, null for unknown names
+    LatencyHistogram *statsFor(const std::string &name) const
+    {
+        std::unordered_map<std::string, BuiltinEntry>::const_iterator it = table.find(name);
+        return it == table.end() ? nullptr : it->second.stats;
+    }
+#endif
+};
+
+struct BuiltinRegistrar
+{
+    BuiltinRegistrar(const char *name, CommandFactory factory, bool pure)
+    {
+        BuiltinRegistry::getInstance().add(name, factory, pure);
+    }
+};
+
+#define REGISTER_BUILTIN(name, cls) \
+    static BuiltinRegistrar _builtin_##cls(name, &_createBuiltin<cls>, false)
+#define REGISTER_PURE_BUILTIN(name, cls) \
+    static BuiltinRegistrar _builtin_##cls(name, &_createBuiltin<cls>, true)
+
 enum executeType
 {
     Normal,
     Redirection
 };
 
+// How external commands are launched. SpawnPosix goes through posix_spawn,
+// which glibc implements with clone(CLONE_VM|CLONE_VFORK) so the shell's
+// address space is never duplicated. SpawnFork is the classic fork+exec path.
+enum SpawnMode
+{
+    SpawnPosix,
+    SpawnFork
+};
+
+// One pending timeout: pid gets SIGKILL at deadline, or SIGTERM first
+// and SIGKILL graceMs later when a grace period was given.
+struct TimerEntry
+{
+    long long deadline; // in TimerWheel ticks
+    pid_t pid;
+    int graceMs;
+    bool terminated; // SIGTERM went out already
+    std::string command;
+    TimerEntry *prev;
+    TimerEntry *next;
+    TimerEntry **head; // slot list we are linked into
+
+    TimerEntry(pid_t pid, const char *command, long long deadline, int graceMs)
+        : deadline(deadline), pid(pid), graceMs(graceMs), terminated(false), command(command),
+          prev(nullptr), next(nullptr), head(nullptr) {}
+};
+
+// Hierarchical timing wheel: LEVELS wheels of SLOTS lists each, level n
+// covering SLOTS^(n+1) ticks. Adding and cancelling a timer is O(1) list
+// work; timers move to a finer level as their slot comes up. Deadlines
+// are absolute ticks of CLOCK_MONOTONIC, a late SIGALRM does not add up.
+class TimerWheel
+{
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    TimerEntry *slots[LEVELS][SLOTS];
+    long long current; // the last tick advance() processed
+    size_t count;
+
+    void place(TimerEntry *entry);
+    void unlink(TimerEntry *entry);
+
+public:
+    static const int TICK_MS = 10;
+
+    TimerWheel();
+    TimerWheel(TimerWheel const &) = delete;
+    void operator=(TimerWheel const &) = delete;
+    static long long nowMs();
+    void add(TimerEntry *entry);
+    void cancel(TimerEntry *entry);
+    // moves the wheel up to tick now, expired timers are unlinked into expired
+    void advance(long long now, std::vector<TimerEntry *> *expired);
+    // the next tick advance() has work at, -1 when no timer is armed
+    long long nextExpiry() const;
+    size_t size() const
+    {
+        return count;
+    }
+};
+
+// An alias with every alias in its first word substituted, lexed once
+struct AliasExpansion
+{
+    std::string text;
+    std::vector<Token> tokens; // text lexed, the token texts live in words
+    std::string words;
+    bool splices; // tokens can be joined with the tokens of the rest of a line
+};
+
+// The alias table: a hash map for lookup, a list for the order alias lists
+// them in. Expansions are memoized per alias and stay valid until the table
+// changes (generation).
+class AliasTable
+{
+    struct Alias
+    {
+        std::string command;
+        std::list<std::string>::iterator position;
+        unsigned long generation; // of the memoized expansion
+        AliasExpansion expansion;
+    };
+    std::unordered_map<std::string, Alias> table;
+    std::list<std::string> order;
+    unsigned long generation;
+
+    void memoize(const std::string &name, Alias *alias);
+
+public:
+    AliasTable() : table(), order(), generation(1) {}
+    AliasTable(AliasTable const &) = delete;
+    void operator=(AliasTable const &) = delete;
+    static bool parseDefinition(const std::string &definition, std::string *name, std::string *command);
+    bool add(const std::string &name, const std::string &command);
+    bool remove(const std::string &name);
+    // nullptr when name is no alias
+    const AliasExpansion *expand(const std::string &name);
+    void print() const;
+    size_t size() const
+    {
+        return table.size();
+    }
+};
+
+// uid/gid -> name, so getuser doesn't go through NSS for every pid. An
+// entry is good until /etc/passwd (users) or /etc/group (groups) changes.
+class IdNameCache
+{
+    std::unordered_map<unsigned, std::string> users;
+    std::unordered_map<unsigned, std::string> groups;
+    struct timespec passwdMtime;
+    struct timespec groupMtime;
+
+public:
+    IdNameCache();
+    // drops what the files changed under, once per command is enough
+    void validate();
+    // false when the id has no name
+    bool userName(uid_t uid, std::string *name);
+    bool groupName(gid_t gid, std::string *name);
+};
+
+// Reads lines from a file descriptor with large read(2) calls, for scripts
+// and piped input where going through std::cin would cost far more.
+class LineReader
+{
+    int fd;
+    std::vector<char> buffer;
+    size_t start;
+    size_t end;
+    bool eof;
+
+public:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    explicit LineReader(int fd) : fd(fd), buffer(BLOCK_SIZE), start(0), end(0), eof(false) {}
+    // false once the input is exhausted, a last line without '\n' still counts
+    bool readLine(std::string *line);
+};
+
+// streambuf behind std::cout: builtins write into one large buffer that is
+// written out with a single write(2) when the shell flushes it (prompt,
+// fork/spawn, fd swaps, blocking waits), not on every std::endl. With a
+// capacity of 0 it passes everything straight through after flushing the
+// buffer given as 'before', which keeps std::cerr ordered behind std::cout.
+class OutputBuffer : public std::streambuf
+{
+    int fd;
+    OutputBuffer *before;
+    std::vector<char> buffer;
+    std::streambuf *replaced;
+    std::ostream *installedOn;
+
+    bool writeAll(const char *data, size_t size);
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char *data, std::streamsize size) override;
+    int sync() override;
+
+public:
+    static const size_t DEFAULT_CAPACITY = 64 * 1024;
+
+    OutputBuffer(int fd, size_t capacity, OutputBuffer *before = nullptr);
+    ~OutputBuffer();
+    OutputBuffer(OutputBuffer const &) = delete;
+    void operator=(OutputBuffer const &) = delete;
+    void install(std::ostream &stream);
+    void flush();
+};
+
 class SmallShell
 {
 public:
@@ -288,11 +861,29 @@ public:
     pid_t shell_PID;
     pid_t foreground_pid;
     Command *foreground_command;
+    SpawnMode spawn_mode;
+    CommandHash *commandHash;
+    int pipe_capacity; // F_SETPIPE_SZ for pipeline pipes, 0 keeps the default
+    OutputBuffer output;
+    OutputBuffer errors;
+    int last_status; // of the last foreground command, smash exits with it
+    TimerWheel timers;
+    std::unordered_map<pid_t, TimerEntry *> timeouts;
+    AliasTable aliases;
+    IdNameCache idNames;
+    // The event loop: SIGINT, SIGTSTP, SIGCHLD and SIGALRM are blocked and
+    // read from signal_fd, every wait goes through one epoll_wait
+    int epoll_fd;
+    int signal_fd;
+    sigset_t handled_signals;
+    bool interrupt_requested; // ctrl-C arrived, for builtins that run until it does
+    struct rusage *rusage_sink; // while set, every child waited for adds its usage here
     // pid_t command_pid; Still unsure if neccesary, initalize to 0 if it is
-    SmallShell() : prompt("smash"), jobsList(new JobsList()), last_dir(""), eventDirectoryHasChanged(false), shell_PID(getpid()), foreground_pid(-1) {}
+    SmallShell();
 
 public:
     Command *CreateCommand(const char *cmd_line);
+    Command *CreateCommand(const char *cmd_line, TokenList lexed);
     SmallShell(SmallShell const &) = delete;     // disable copy ctor
     void operator=(SmallShell const &) = delete; // disable = operator
     std::string getPrompt()
@@ -307,8 +898,27 @@ public:
     }
     ~SmallShell();
     void UpdateForeground(Command *command, pid_t pid);
+    pid_t spawnProcess(const char *file, char *const argv[], int fd_in = -1, int fd_out = -1, int fd_err = -1);
+    Command *prepareCommand(const char *cmd_line);
     void executeCommand(const char *cmd_line);
+    void flushOutput();
+    void armTimeout(pid_t pid, const char *command, int seconds, int graceSeconds);
+    void cancelTimeout(pid_t pid);
+    void handleAlarm();
+    void rearmAlarm();
+    bool startEventLoop();
+    void leaveEventLoop();
+    bool eventLoopRunning() const
+    {
+        return epoll_fd != -1;
+    }
+    bool pollEvents(int fd, int timeout_ms = -1);
+    void dispatchSignals();
     // TODO: add extra methods as needed
 };
 
+// perror that first writes out what builtins left in the std::cout buffer,
+// so the message shows up after the output that came before it
+void _perror(const char *message);
+
 #endif // SMASH_COMMAND_H_
@@ -0,0 +1,425 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <new>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "Commands.h"
+#include "signals.h"
+
+// Microbenchmarks for the shell's hot paths, built and run by `make bench`.
+// Results go to stdout as one JSON document; everything the benchmarked
+// commands print goes to /dev/null.
+//
+//   smash_bench [--quick]
+//
+// --quick shrinks the pipe and script sizes for a fast smoke run.
+
+int _parseCommandLine(const char *cmd_line, char ***args, CommandArena *arena);
+
+////////////////////////////////////////////////////////////////////////
+///                          #Allocation count                        ///
+////////////////////////////////////////////////////////////////////////
+
+// Every operator new in the binary, Commands.o included, is counted here
+static unsigned long allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *block = malloc(size > 0 ? size : 1);
+    if (block == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *block) noexcept
+{
+    free(block);
+}
+
+void operator delete[](void *block) noexcept
+{
+    free(block);
+}
+
+////////////////////////////////////////////////////////////////////////
+///                              #Harness                             ///
+////////////////////////////////////////////////////////////////////////
+
+static double _nowSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// One JSON object per measurement, collected in run order
+class BenchReport
+{
+    std::vector<std::string> results;
+
+public:
+    // iterations ops took seconds; allocs is what they allocated in total
+    void add(const std::string &name, long iterations, double seconds, unsigned long allocs,
+             const std::string &extra = "")
+    {
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "{\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, "
+                 "\"allocs_per_op\": %.2f%s%s}",
+                 name.c_str(), iterations, seconds * 1e9 / iterations, iterations / seconds,
+                 (double)allocs / iterations, extra.empty() ? "" : ", ", extra.c_str());
+        results.push_back(line);
+    }
+    std::string json() const
+    {
+        std::string out = "{\n  \"benchmark\": \"smash\",\n  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            out += "    " + results[i] + (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        return out + "  ]\n}\n";
+    }
+};
+
+// Runs body iterations times and records it under name
+template <typename Body>
+static void _measure(BenchReport *report, const std::string &name, long iterations, Body body,
+                     const std::string &extra = "")
+{
+    unsigned long allocs_before = allocations;
+    double start = _nowSeconds();
+    for (long i = 0; i < iterations; i++)
+    {
+        body(i);
+    }
+    double seconds = _nowSeconds() - start;
+    report->add(name, iterations, seconds, allocations - allocs_before, extra);
+}
+
+////////////////////////////////////////////////////////////////////////
+///                             #Benchmarks                           ///
+////////////////////////////////////////////////////////////////////////
+
+static void _benchParse(BenchReport *report)
+{
+    const char *lines[] = {"showpid", "ls -l /tmp 'a b' \"c d\" > out.txt", "cat a.txt | grep -v x |& sort &"};
+    const char *names[] = {"parse_short", "parse_quoted_redirect", "parse_pipeline"};
+    for (int l = 0; l < 3; l++)
+    {
+        CommandArena arena;
+        char **args;
+        _measure(report, names[l], 1000000, [&](long) {
+            _parseCommandLine(lines[l], &args, &arena);
+            arena.reset();
+        });
+    }
+}
+
+static void _benchDispatch(BenchReport *report)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    _measure(report, "dispatch_builtin", 500000, [&](long) { delete smash.CreateCommand("showpid"); });
+    _measure(report, "dispatch_external", 500000, [&](long) { delete smash.CreateCommand("ls -l /tmp"); });
+    _measure(report, "dispatch_pipeline", 500000, [&](long) { delete smash.CreateCommand("ls | wc -l"); });
+}
+
+static void _benchAliases(BenchReport *report)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.aliases.add("ll", "ls -l");
+    smash.aliases.add("lla", "ll -a");
+    _measure(report, "alias_expand", 1000000, [&](long) { smash.aliases.expand("ll"); });
+    _measure(report, "alias_expand_recursive", 1000000, [&](long) { smash.aliases.expand("lla"); });
+    _measure(report, "alias_prepare", 500000, [&](long) { delete smash.prepareCommand("lla /tmp"); });
+
+    // 10k definitions through the alias builtin, then lookups among them
+    const long NUM_ALIASES = 10000;
+    std::vector<std::string> definitions;
+    std::vector<std::string> names;
+    for (long i = 0; i < NUM_ALIASES; i++)
+    {
+        names.push_back("a" + std::to_string(i));
+        definitions.push_back("alias " + names.back() + "='ls -l /tmp/" + std::to_string(i) + "'");
+    }
+    _measure(report, "alias_define_10k", NUM_ALIASES,
+             [&](long i) { smash.executeCommand(definitions[i].c_str()); });
+    _measure(report, "alias_expand_10k", 1000000,
+             [&](long i) { smash.aliases.expand(names[(i * 7919) % NUM_ALIASES]); });
+    _measure(report, "alias_prepare_10k", 500000,
+             [&](long i) { delete smash.prepareCommand(names[(i * 7919) % NUM_ALIASES].c_str()); });
+    for (long i = 0; i < NUM_ALIASES; i++)
+    {
+        smash.aliases.remove(names[i]);
+    }
+}
+
+// Jobs with pids no process can have, nothing is ever signalled or reaped
+static void _benchJobs(BenchReport *report, long num_jobs)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    JobsList *jobs = smash.jobsList;
+    const pid_t FAKE_PID_BASE = 1 << 30;
+    std::string suffix = "_" + std::to_string(num_jobs);
+
+    std::vector<Command *> commands;
+    for (long i = 0; i < num_jobs; i++)
+    {
+        commands.push_back(smash.CreateCommand("sleep 100&"));
+    }
+    _measure(report, "jobs_add" + suffix, num_jobs,
+             [&](long i) { jobs->addJob(commands[i], FAKE_PID_BASE + (pid_t)i); });
+    long lookups = 1000000;
+    _measure(report, "jobs_get_by_id" + suffix, lookups,
+             [&](long i) { jobs->getJobById(1 + (int)((i * 7919) % num_jobs)); });
+    _measure(report, "jobs_get_by_pid" + suffix, lookups,
+             [&](long i) { jobs->getJobByPID(FAKE_PID_BASE + (pid_t)((i * 7919) % num_jobs)); });
+    _measure(report, "jobs_remove_finished" + suffix, lookups, [&](long) { jobs->removeFinishedJobs(); });
+    _measure(report, "jobs_print" + suffix, 10, [&](long) {
+        jobs->printJobsList();
+        smash.flushOutput();
+    });
+    _measure(report, "jobs_remove" + suffix, num_jobs, [&](long i) { jobs->removeJobById(1 + (int)i); });
+}
+
+// A forked copy of the bench that stops itself, added as a stopped job.
+// With stop_again it stops each time it is continued, otherwise it exits.
+static pid_t _addStoppedJob(JobsList *jobs, bool stop_again, int *job_id)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    smash.flushOutput();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("smash_bench: fork failed");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        do
+        {
+            raise(SIGSTOP);
+        } while (stop_again);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, WUNTRACED);
+    jobs->addJob(smash.CreateCommand("sleep 100&"), pid, true);
+    *job_id = jobs->maxJobID - 1;
+    return pid;
+}
+
+// jobs, bg, fg and kill through executeCommand on a list of num_jobs jobs,
+// num_real of each kind being real processes and the rest fake pids
+static void _benchJobCommands(BenchReport *report, long num_jobs, long num_real)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    JobsList *jobs = smash.jobsList;
+    const pid_t FAKE_PID_BASE = 1 << 30;
+    std::string suffix = "_" + std::to_string(num_jobs);
+
+    for (long i = 0; i < num_jobs - 3 * num_real; i++)
+    {
+        jobs->addJob(smash.CreateCommand("sleep 100&"), FAKE_PID_BASE + (pid_t)i);
+    }
+    // [0, num_real) for bg, then fg, then kill
+    std::vector<pid_t> pids;
+    std::vector<int> ids;
+    for (long i = 0; i < 3 * num_real; i++)
+    {
+        int id;
+        pid_t pid = _addStoppedJob(jobs, i < num_real, &id);
+        if (pid == -1)
+        {
+            return;
+        }
+        pids.push_back(pid);
+        ids.push_back(id);
+    }
+
+    std::vector<std::string> lines;
+    for (long i = 0; i < 3 * num_real; i++)
+    {
+        const char *verb = (i < num_real) ? "bg " : (i < 2 * num_real) ? "fg " : "kill -9 ";
+        lines.push_back(verb + std::to_string(ids[i]));
+    }
+    _measure(report, "jobs_cmd_jobs" + suffix, 5, [&](long) {
+        smash.executeCommand("jobs");
+        smash.flushOutput();
+    });
+    _measure(report, "jobs_cmd_bg" + suffix, num_real, [&](long i) { smash.executeCommand(lines[i].c_str()); });
+    _measure(report, "jobs_cmd_fg" + suffix, num_real,
+             [&](long i) { smash.executeCommand(lines[num_real + i].c_str()); });
+    _measure(report, "jobs_cmd_kill" + suffix, num_real,
+             [&](long i) { smash.executeCommand(lines[2 * num_real + i].c_str()); });
+
+    // the bg ones are still around, stopped again
+    for (size_t i = 0; i < pids.size(); i++)
+    {
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], nullptr, 0);
+    }
+    while (jobs->maxJobID > 1)
+    {
+        jobs->removeJobById(jobs->maxJobID - 1);
+    }
+    smash.flushOutput();
+}
+
+static void _benchSpawn(BenchReport *report)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    char *argv[] = {(char *)"true", nullptr};
+    SpawnMode modes[] = {SpawnPosix, SpawnFork};
+    const char *names[] = {"spawn_posix_true", "spawn_fork_true"};
+    for (int m = 0; m < 2; m++)
+    {
+        smash.spawn_mode = modes[m];
+        _measure(report, names[m], 2000, [&](long) {
+            pid_t pid = smash.spawnProcess(argv[0], argv, -1, -1, -1);
+            int status;
+            waitpid(pid, &status, 0);
+        });
+    }
+    smash.spawn_mode = SpawnPosix;
+}
+
+static void _benchRedirection(BenchReport *report)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    char path[] = "/tmp/smash_bench_redirectXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        perror("smash_bench: mkstemp failed");
+        return;
+    }
+    close(fd);
+    std::string over = std::string("showpid > ") + path;
+    std::string append = std::string("showpid >> ") + path;
+    _measure(report, "redirect_builtin", 20000, [&](long) { smash.executeCommand(over.c_str()); });
+    _measure(report, "redirect_builtin_append", 20000, [&](long) { smash.executeCommand(append.c_str()); });
+    unlink(path);
+}
+
+// bytes from head through stages-1 cats, for the default pipe size and 1 MiB
+static void _benchPipes(BenchReport *report, long long bytes)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    int stage_counts[] = {2, 4, 8};
+    int capacities[] = {0, 1 << 20};
+    for (int c = 0; c < 2; c++)
+    {
+        smash.pipe_capacity = capacities[c];
+        for (int s = 0; s < 3; s++)
+        {
+            std::string line = "head -c " + std::to_string(bytes) + " /dev/zero";
+            for (int i = 1; i < stage_counts[s]; i++)
+            {
+                line += " | cat";
+            }
+            unsigned long allocs_before = allocations;
+            double start = _nowSeconds();
+            smash.executeCommand(line.c_str());
+            double seconds = _nowSeconds() - start;
+            char extra[128];
+            snprintf(extra, sizeof(extra), "\"bytes\": %lld, \"bytes_per_sec\": %.0f, \"pipe_size\": %d", bytes,
+                     bytes / seconds, capacities[c]);
+            report->add("pipe_" + std::to_string(stage_counts[s]) + "_stage" + (capacities[c] ? "_1m" : ""), 1,
+                        seconds, allocations - allocs_before, extra);
+        }
+    }
+    smash.pipe_capacity = 0;
+}
+
+static void _benchScript(BenchReport *report, long num_lines)
+{
+    SmallShell &smash = SmallShell::getInstance();
+    char path[] = "/tmp/smash_bench_scriptXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        perror("smash_bench: mkstemp failed");
+        return;
+    }
+    std::string block;
+    for (long i = 0; i < num_lines; i++)
+    {
+        block += (i % 2 == 0) ? "showpid\n" : "chprompt bench\n";
+        if (block.size() > (1 << 16) || i + 1 == num_lines)
+        {
+            if (write(fd, block.data(), block.size()) != (ssize_t)block.size())
+            {
+                perror("smash_bench: write failed");
+            }
+            block.clear();
+        }
+    }
+    close(fd);
+
+    std::string line = std::string("source ") + path;
+    unsigned long allocs_before = allocations;
+    double start = _nowSeconds();
+    smash.executeCommand(line.c_str());
+    smash.flushOutput();
+    double seconds = _nowSeconds() - start;
+    report->add("script_lines", num_lines, seconds, allocations - allocs_before);
+    unlink(path);
+}
+
+int main(int argc, char *argv[])
+{
+    bool quick = (argc > 1 && strcmp(argv[1], "--quick") == 0);
+    SmallShell &smash = SmallShell::getInstance();
+    if (!smash.startEventLoop())
+    {
+        return 1;
+    }
+
+    // the JSON keeps the real stdout, the commands get /dev/null
+    int json_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (json_fd == -1 || null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+    {
+        perror("smash_bench: dup2 failed");
+        return 1;
+    }
+    close(null_fd);
+
+    BenchReport report;
+    _benchParse(&report);
+    _benchDispatch(&report);
+    _benchAliases(&report);
+    _benchJobs(&report, 10);
+    _benchJobs(&report, 1000);
+    _benchJobs(&report, 100000);
+    _benchJobCommands(&report, 50000, quick ? 100 : 1000);
+    _benchSpawn(&report);
+    _benchRedirection(&report);
+    _benchPipes(&report, quick ? (64LL << 20) : (1LL << 30));
+    _benchScript(&report, quick ? 100000 : 1000000);
+
+    smash.flushOutput();
+    std::string json = report.json();
+    if (write(json_fd, json.data(), json.size()) != (ssize_t)json.size())
+    {
+        perror("smash_bench: write failed");
+        return 1;
+    }
+    return 0;
+}
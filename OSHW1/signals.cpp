@@ -5,6 +5,13 @@
 
 using namespace std;
 
+volatile sig_atomic_t childStateChanged = 0;
+volatile sig_atomic_t alarmFired = 0;
+
+// None of these run in signal context: the signals are blocked and read
+// from a signalfd, SmallShell::dispatchSignals calls the matching handler
+// from the event loop. That is what lets them print and touch the job list.
+
 void ctrlZHandler(int sig_num)
 {
     std::cout << "smash: got ctrl-Z" << std::endl;
@@ -18,7 +25,7 @@ void ctrlZHandler(int sig_num)
     }
     if (kill(Fpid, SIGSTOP) == -1)
     {
-        perror("smash error: kill failed");
+        _perror("smash error: kill failed");
         return;
     }
     JobEntry *existing_job = smash.jobsList->getJobByPID(Fpid);
@@ -26,7 +33,7 @@ void ctrlZHandler(int sig_num)
     {
         // Job exists already, update it to Stopped
         existing_job->isBackground = false;
-        existing_job->isStopped = true;
+        smash.jobsList->setStopped(existing_job, true);
     }
     else
     {
@@ -42,6 +49,7 @@ void ctrlCHandler(int sig_num)
 {
     std::cout << "smash: got ctrl-C" << std::endl;
     SmallShell &smash = SmallShell::getInstance();
+    smash.interrupt_requested = true;
     // Check if there is a foreground job
     pid_t Fpid = smash.foreground_pid;
     if (Fpid == -1)
@@ -51,11 +59,12 @@ void ctrlCHandler(int sig_num)
     }
     if (kill(Fpid, SIGKILL) == -1)
     {
-        perror("smash error: kill failed");
+        _perror("smash error: kill failed");
         return;
     }
 
     std::cout << "smash: process " << Fpid << " was killed" << std::endl;
+    // the foreground wait reaps the process, the job can go right away
     if (smash.jobsList->getJobByPID(Fpid) != nullptr)
     {
         smash.jobsList->removeJobById(smash.jobsList->getJobByPID(Fpid)->jobID);
@@ -70,7 +79,17 @@ void ctrlCHandler(int sig_num)
     return;
 }
 
+// The expired timeouts are handled (and reported) by SmallShell::handleAlarm
+// right after the event loop dispatched this. Not every alarm expires a
+// timeout, some only move timers down the wheel.
 void alarmHandler(int sig_num)
 {
-    // TODO: Add your implementation
+    alarmFired = 1;
+}
+
+// Only records that some child changed state, the reaping itself happens
+// in JobsList::removeFinishedJobs when the job list is next used.
+void childHandler(int sig_num)
+{
+    childStateChanged = 1;
 }
@@ -1,8 +1,17 @@
 #ifndef SMASH__SIGNALS_H_
 #define SMASH__SIGNALS_H_
 
+#include <signal.h>
+
+// Called by SmallShell::dispatchSignals from the event loop
 void ctrlZHandler(int sig_num);
 void ctrlCHandler(int sig_num);
 void alarmHandler(int sig_num);
+void childHandler(int sig_num);
+
+// Set by childHandler, consumed by JobsList::removeFinishedJobs
+extern volatile sig_atomic_t childStateChanged;
+// Set by alarmHandler, consumed by SmallShell::handleAlarm
+extern volatile sig_atomic_t alarmFired;
 
 #endif // SMASH__SIGNALS_H_
@@ -2,30 +2,95 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <string.h>
+#include <fcntl.h>
 #include "Commands.h"
 #include "signals.h"
 
 int main(int argc, char *argv[])
 {
-    if (signal(SIGTSTP, ctrlZHandler) == SIG_ERR)
+    SmallShell &smash = SmallShell::getInstance();
+
+    // ctrl-C, ctrl-Z, SIGCHLD and SIGALRM are read from a signalfd and
+    // handled by the event loop, see SmallShell::pollEvents
+    if (!smash.startEventLoop())
     {
-        perror("smash error: failed to set ctrl-Z handler");
+        return 1;
     }
-    if (signal(SIGINT, ctrlCHandler) == SIG_ERR)
+
+    // --spawn=fork falls back to the classic fork+exec launcher,
+    // --pipe-size=BYTES grows the pipes between pipeline stages,
+    // -c "line" runs a single line, a file name runs that file as a script
+    const char *one_shot = nullptr;
+    const char *script = nullptr;
+    for (int i = 1; i < argc; i++)
     {
-        perror("smash error: failed to set ctrl-C handler");
+        if (strncmp(argv[i], "--pipe-size=", 12) == 0)
+        {
+            smash.pipe_capacity = atoi(argv[i] + 12);
+            continue;
+        }
+        if (strcmp(argv[i], "--spawn=fork") == 0)
+        {
+            smash.spawn_mode = SpawnFork;
+        }
+        else if (strcmp(argv[i], "--spawn=posix") == 0)
+        {
+            smash.spawn_mode = SpawnPosix;
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && one_shot == nullptr)
+        {
+            one_shot = argv[++i];
+        }
+        else if (argv[i][0] != '-' && script == nullptr && one_shot == nullptr)
+        {
+            script = argv[i];
+        }
+        else
+        {
+            std::cerr << "smash error: invalid option " << argv[i] << std::endl;
+            return 1;
+        }
     }
 
-    // TODO: setup sig alarm handler
+    if (one_shot != nullptr)
+    {
+        smash.executeCommand(one_shot);
+        smash.flushOutput();
+        return smash.last_status;
+    }
 
-    SmallShell &smash = SmallShell::getInstance();
+    int input_fd = STDIN_FILENO;
+    if (script != nullptr)
+    {
+        input_fd = open(script, O_RDONLY | O_CLOEXEC);
+        if (input_fd == -1)
+        {
+            _perror("smash error: open failed");
+            return 1;
+        }
+    }
+    // a prompt is only useful to someone typing
+    bool interactive = (script == nullptr) && isatty(STDIN_FILENO);
+
+    LineReader reader(input_fd);
+    std::string cmd_line_grab;
     while (true)
     {
-        std::cout << smash.prompt << "> ";
-        std::string cmd_line_grab;
-        std::getline(std::cin, cmd_line_grab);
+        if (interactive)
+        {
+            // the prompt goes out in the same write as the last command's output
+            std::cout << smash.prompt << "> ";
+            smash.flushOutput();
+        }
+        if (!reader.readLine(&cmd_line_grab))
+        {
+            break;
+        }
 
         smash.executeCommand(cmd_line_grab.c_str());
+        smash.handleAlarm();
     }
-    return 0;
+    smash.flushOutput();
+    return smash.last_status;
 }
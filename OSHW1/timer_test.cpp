@@ -0,0 +1,117 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Commands.h"
+
+// Checks for TimerWheel, built and run by `make test`. Timers are driven
+// the way rearmAlarm and handleAlarm drive them: advance straight to the
+// tick nextExpiry reports, as a SIGALRM right on time would. A timer has
+// to expire exactly at its deadline, never be lost in between.
+
+static int failures = 0;
+
+static void _fail(const std::string &what)
+{
+    std::cerr << "FAILED: " << what << std::endl;
+    failures++;
+}
+
+// Adds a timer delta ticks from now for every delta, then follows
+// nextExpiry until all of them expired
+static void _checkDeltas(const std::vector<long long> &deltas)
+{
+    TimerWheel wheel;
+    std::vector<TimerEntry *> entries;
+    long long now = TimerWheel::nowMs() / TimerWheel::TICK_MS;
+    for (size_t i = 0; i < deltas.size(); i++)
+    {
+        entries.push_back(new TimerEntry(1, "sleep", now + deltas[i], 0));
+        wheel.add(entries.back());
+    }
+
+    std::string name = "delta " + std::to_string(deltas[0]);
+    if (deltas.size() > 1)
+    {
+        name = std::to_string(deltas.size()) + " timers";
+    }
+    size_t left = entries.size();
+    long long last = 0;
+    while (left > 0)
+    {
+        long long next = wheel.nextExpiry();
+        if (next == -1)
+        {
+            _fail(name + ": nextExpiry is -1 with " + std::to_string(left) + " timers armed");
+            break;
+        }
+        if (next <= last)
+        {
+            _fail(name + ": nextExpiry went back to tick " + std::to_string(next));
+            break;
+        }
+        last = next;
+        std::vector<TimerEntry *> expired;
+        wheel.advance(next, &expired);
+        for (size_t i = 0; i < expired.size(); i++)
+        {
+            if (expired[i]->deadline != next)
+            {
+                _fail(name + ": timer for tick " + std::to_string(expired[i]->deadline) +
+                      " expired at tick " + std::to_string(next));
+            }
+        }
+        left -= expired.size();
+    }
+    if (left == 0 && wheel.size() != 0)
+    {
+        _fail(name + ": size is " + std::to_string(wheel.size()) + " with nothing armed");
+    }
+    if (left == 0 && wheel.nextExpiry() != -1)
+    {
+        _fail(name + ": nextExpiry is not -1 with nothing armed");
+    }
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        wheel.cancel(entries[i]);
+        delete entries[i];
+    }
+}
+
+int main()
+{
+    // every delta the two finest levels hold, then around each level
+    // boundary and a full turn of each level after it, and past the span
+    // of the wheel, where timers are parked and placed again
+    for (long long delta = 1; delta <= 64 * 64 + 64; delta++)
+    {
+        _checkDeltas(std::vector<long long>(1, delta));
+    }
+    std::vector<long long> all;
+    for (long long span = 64; span <= 64LL * 64 * 64; span *= 64)
+    {
+        long long around[] = {span - 2, span - 1, span, span + 1, 2 * span - 1, 2 * span,
+                              64 * span - span, 64 * span - span / 64, 64 * span - 1, 64 * span};
+        for (int i = 0; i < 10; i++)
+        {
+            _checkDeltas(std::vector<long long>(1, around[i]));
+            all.push_back(around[i]);
+        }
+    }
+    long long parked[] = {64LL * 64 * 64 * 64 + 1, 2 * 64LL * 64 * 64 * 64};
+    for (int i = 0; i < 2; i++)
+    {
+        _checkDeltas(std::vector<long long>(1, parked[i]));
+        all.push_back(parked[i]);
+    }
+
+    // several pending at once, the wheel moving on while they wait
+    _checkDeltas(all);
+
+    if (failures != 0)
+    {
+        std::cerr << failures << " TimerWheel checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "TimerWheel ++PASSED++" << std::endl;
+    return 0;
+}